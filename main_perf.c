@@ -52,6 +52,185 @@ int main()
     cpu_time = ((double)(end - start)) / CLOCKS_PER_SEC;
     printf("MAGICmap(OUT->IN) #%d: %.3f sec\n", N, cpu_time);
 
+    MAGICdestroy(m);
+
+    // === TEST: MAGICadd at the end of the stream ===
+    m = MAGICinit();
+    start = clock();
+    for (int i = 0; i < N; ++i) 
+    {
+        MAGICadd(m, 2 * i, 1);
+    }
+    (void)MAGICmap(m, STREAM_IN_OUT, 0);
+    end = clock();
+    cpu_time = ((double)(end - start)) / CLOCKS_PER_SEC;
+    printf("MAGICadd(tail) #%d: %.3f sec\n", N, cpu_time);
+
+    // === TEST: MAGICmapBatch at random positions, no page cached (dense enough to fill them) ===
+    int *positions = malloc(N * sizeof(int));
+    int *results = malloc(N * sizeof(int));
+    unsigned int seed = 1;
+    for (int i = 0; i < N; ++i) 
+    {
+        seed = seed * 1664525u + 1013904223u;
+        positions[i] = (int)(seed >> 11) % (3 * N);
+    }
+    start = clock();
+    MAGICmapBatch(m, STREAM_IN_OUT, positions, results, N);
+    end = clock();
+    cpu_time = ((double)(end - start)) / CLOCKS_PER_SEC;
+    printf("MAGICmapBatch(IN->OUT, cold) #%d: %.3f sec\n", N, cpu_time);
+
+    // === TEST: MAGICmap at the same random positions, pages resident ===
+    start = clock();
+    for (int i = 0; i < N; ++i) 
+    {
+        results[i] = MAGICmap(m, STREAM_IN_OUT, positions[i]);
+    }
+    end = clock();
+    cpu_time = ((double)(end - start)) / CLOCKS_PER_SEC;
+    printf("MAGICmap(IN->OUT, random) #%d: %.3f sec\n", N, cpu_time);
+
+    // === TEST: MAGICmapBatch at the same random positions, pages resident ===
+    start = clock();
+    MAGICmapBatch(m, STREAM_IN_OUT, positions, results, N);
+    end = clock();
+    cpu_time = ((double)(end - start)) / CLOCKS_PER_SEC;
+    printf("MAGICmapBatch(IN->OUT, cached) #%d: %.3f sec\n", N, cpu_time);
+
+    // === TEST: MAGICmap on a few thousand hot positions ===
+    start = clock();
+    for (int i = 0; i < N; ++i) 
+    {
+        (void)MAGICmap(m, STREAM_IN_OUT, (i % 4000) * 499);
+    }
+    end = clock();
+    cpu_time = ((double)(end - start)) / CLOCKS_PER_SEC;
+    printf("MAGICmap(hot) #%d: %.3f sec\n", N, cpu_time);
+
+    // === TEST: MAGICmap at random positions on a frozen mapping ===
+    start = clock();
+    MAGICfreeze(m);
+    end = clock();
+    cpu_time = ((double)(end - start)) / CLOCKS_PER_SEC;
+    printf("MAGICfreeze #%d: %.3f sec\n", N, cpu_time);
+    seed = 1;
+    start = clock();
+    for (int i = 0; i < N; ++i) 
+    {
+        seed = seed * 1664525u + 1013904223u;
+        (void)MAGICmap(m, i & 1 ? STREAM_OUT_IN : STREAM_IN_OUT, (int)(seed >> 11) % (3 * N));
+    }
+    end = clock();
+    cpu_time = ((double)(end - start)) / CLOCKS_PER_SEC;
+    printf("MAGICmap(frozen) #%d: %.3f sec\n", N, cpu_time);
+
+    // === TEST: MAGICmap on hot positions of a frozen mapping (cached pages) ===
+    start = clock();
+    for (int i = 0; i < N; ++i) 
+    {
+        (void)MAGICmap(m, STREAM_IN_OUT, (i % 4000) * 499);
+    }
+    end = clock();
+    cpu_time = ((double)(end - start)) / CLOCKS_PER_SEC;
+    printf("MAGICmap(frozen, hot) #%d: %.3f sec\n", N, cpu_time);
+
+    // === TEST: MAGICmapBatch at random positions on a frozen mapping ===
+    seed = 1;
+    for (int i = 0; i < N; ++i) 
+    {
+        seed = seed * 1664525u + 1013904223u;
+        positions[i] = (int)(seed >> 11) % (3 * N);
+    }
+    start = clock();
+    MAGICmapBatch(m, STREAM_OUT_IN, positions, positions, N);
+    end = clock();
+    cpu_time = ((double)(end - start)) / CLOCKS_PER_SEC;
+    printf("MAGICmapBatch(frozen) #%d: %.3f sec\n", N, cpu_time);
+    MAGICdestroy(m);
+
+    // === TEST: MAGICmap vs MAGICmapBatch over more positions than the cache holds ===
+    m = MAGICinit();
+    MAGICOptions noCache = { 0 };
+    MAGIC plain = MAGICinitWithOptions(&noCache);
+    seed = 1;
+    for (int i = 0; i < N; ++i) 
+    {
+        seed = seed * 1664525u + 1013904223u;
+        MAGICadd(m, (int)(seed >> 4) % (100 * N), 1);
+        MAGICadd(plain, (int)(seed >> 4) % (100 * N), 1);
+    }
+    for (int i = 0; i < N / 10; ++i) 
+    {
+        seed = seed * 1664525u + 1013904223u;
+        positions[i] = (int)(seed >> 4) % (100 * N);
+    }
+    (void)MAGICmap(m, STREAM_IN_OUT, 0);
+    for (int direction = STREAM_IN_OUT; direction <= STREAM_OUT_IN; ++direction) 
+    {
+        start = clock();
+        for (int i = 0; i < N / 10; ++i) 
+        {
+            results[i] = MAGICmap(m, direction, positions[i]);
+        }
+        end = clock();
+        cpu_time = ((double)(end - start)) / CLOCKS_PER_SEC;
+        printf("MAGICmap(%s, wide) #%d: %.3f sec\n", direction == STREAM_IN_OUT ? "IN->OUT" : "OUT->IN", N / 10, cpu_time);
+
+        start = clock();
+        for (int i = 0; i < N / 10; ++i) 
+        {
+            results[i] = MAGICmap(plain, direction, positions[i]);
+        }
+        end = clock();
+        cpu_time = ((double)(end - start)) / CLOCKS_PER_SEC;
+        printf("MAGICmap(%s, wide, no cache) #%d: %.3f sec\n", direction == STREAM_IN_OUT ? "IN->OUT" : "OUT->IN", N / 10, cpu_time);
+
+        start = clock();
+        MAGICmapBatch(m, direction, positions, results, N / 10);
+        end = clock();
+        cpu_time = ((double)(end - start)) / CLOCKS_PER_SEC;
+        printf("MAGICmapBatch(%s, wide) #%d: %.3f sec\n", direction == STREAM_IN_OUT ? "IN->OUT" : "OUT->IN", N / 10, cpu_time);
+    }
+    free(positions);
+    free(results);
+    MAGICdestroy(plain);
+    MAGICdestroy(m);
+
+    // === TEST: bursts of edits at random positions, each followed by a few queries ===
+    m = MAGICinit();
+    for (int i = 0; i < N; ++i)
+    {
+        MAGICadd(m, 2 * i, 1);
+    }
+    (void)MAGICmap(m, STREAM_IN_OUT, 0);
+    seed = 1;
+    clock_t editTime = 0, mapTime = 0;
+    for (int burst = 0; burst < 100; ++burst)
+    {
+        start = clock();
+        for (int i = 0; i < 1000; ++i)
+        {
+            seed = seed * 1664525u + 1013904223u;
+            int pos = (int)(seed >> 4) % (2 * N);
+            if (i & 1)
+                MAGICremove(m, pos, 1);
+            else
+                MAGICadd(m, pos, 1);
+        }
+        editTime += clock() - start;
+
+        start = clock();
+        for (int i = 0; i < 10; ++i)
+        {
+            seed = seed * 1664525u + 1013904223u;
+            (void)MAGICmap(m, i & 1 ? STREAM_OUT_IN : STREAM_IN_OUT, (int)(seed >> 4) % (2 * N));
+        }
+        mapTime += clock() - start;
+    }
+    printf("MAGICadd/MAGICremove(random bursts) #%d: %.3f sec\n", 100 * 1000, (double)editTime / CLOCKS_PER_SEC);
+    printf("MAGICmap(after random bursts) #%d: %.3f sec\n", 100 * 10, (double)mapTime / CLOCKS_PER_SEC);
+
     MAGICdestroy(m);
     return 0;
 }
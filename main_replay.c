@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "magic.h"
+
+// Number of latency buckets (bucket i counts latencies in [2^(i-1), 2^i) ns)
+#define BUCKETS 40
+// Number of mismatches printed when verifying
+#define MAX_REPORTED 10
+
+// Record types of a trace
+enum Operation { OP_ADD, OP_REMOVE, OP_MAP, OP_COUNT };
+static const char *operationNames[OP_COUNT] = { "add", "remove", "map" };
+
+/// @brief Get a monotonic timestamp.
+/// @return Time in nanoseconds
+static long long nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/// @brief Check whether a character separates the fields of a record.
+/// @param c Character to check
+/// @return 1 for a blank, 0 otherwise
+static int isBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+/// @brief Parse a decimal integer, skipping blanks before it.
+/// @param cursor Pointer to the current position, moved past the integer
+/// @param end End of the line
+/// @param value Set to the parsed integer
+/// @return 1 if an integer fitting in an int was parsed, 0 otherwise
+static int parseInt(const char **cursor, const char *end, int *value)
+{
+    const char *p = *cursor;
+    while (p < end && isBlank(*p))
+        p++;
+    int negative = p < end && *p == '-';
+    if (negative)
+        p++;
+    if (p == end || *p < '0' || *p > '9')
+        return 0;
+    long long result = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+    {
+        result = result * 10 + (*p++ - '0');
+        if (result > (long long)INT_MAX + negative)
+            return 0;
+    }
+    // The integer must be followed by a blank or the end of the line
+    if (p < end && !isBlank(*p))
+        return 0;
+    *value = (int)(negative ? -result : result);
+    *cursor = p;
+    return 1;
+}
+
+/// @brief Parse a cache budget, as strictly as the fields of a record.
+/// @param text Text of the option
+/// @param value Set to the parsed budget
+/// @return 1 if the whole text is a decimal number fitting in a size_t, 0 otherwise
+static int parseBudget(const char *text, size_t *value)
+{
+    if (*text == '\0')
+        return 0;
+    size_t result = 0;
+    for (; *text; text++)
+    {
+        if (*text < '0' || *text > '9' || result > (SIZE_MAX - (size_t)(*text - '0')) / 10)
+            return 0;
+        result = result * 10 + (size_t)(*text - '0');
+    }
+    *value = result;
+    return 1;
+}
+
+/// @brief Check that nothing but blanks is left on a line.
+/// @param p Current position
+/// @param end End of the line
+/// @return 1 if the rest of the line is blank, 0 otherwise
+static int atEnd(const char *p, const char *end)
+{
+    while (p < end && isBlank(*p))
+        p++;
+    return p == end;
+}
+
+/// @brief Get the latency bucket of a duration.
+/// @param ns Duration in nanoseconds
+/// @return Bucket index
+static int bucketOf(long long ns)
+{
+    int bucket = 0;
+    while (ns > 0 && bucket < BUCKETS - 1)
+    {
+        ns >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-v] [-b budget] trace\n", name);
+    fprintf(stderr, "  -v         verify the results recorded in the trace\n");
+    fprintf(stderr, "  -b budget  cache budget in bytes (default %zu)\n", (size_t)MAGIC_DEFAULT_CACHE_BUDGET);
+    fprintf(stderr, "Trace records, one per line ('#' starts a comment):\n");
+    fprintf(stderr, "  a <pos> <length>              MAGICadd\n");
+    fprintf(stderr, "  r <pos> <length>              MAGICremove\n");
+    fprintf(stderr, "  m <direction> <pos> [result]  MAGICmap (0: IN -> OUT, 1: OUT -> IN)\n");
+    fprintf(stderr, "  f                             MAGICfreeze (not timed)\n");
+}
+
+int main(int argc, char **argv)
+{
+    int verify = 0;
+    MAGICOptions options = { MAGIC_DEFAULT_CACHE_BUDGET };
+    int opt;
+    while ((opt = getopt(argc, argv, "vb:")) != -1)
+    {
+        if (opt == 'v')
+            verify = 1;
+        else if (opt == 'b')
+        {
+            if (!parseBudget(optarg, &options.cacheBudget))
+            {
+                fprintf(stderr, "%s: invalid cache budget '%s'\n", argv[0], optarg);
+                return EXIT_FAILURE;
+            }
+        }
+        else
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Map the whole trace in memory
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd < 0)
+    {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        perror("fstat");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    size_t size = (size_t)st.st_size;
+    const char *trace = "";
+    if (size > 0)
+    {
+        trace = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (trace == MAP_FAILED)
+        {
+            perror("mmap");
+            close(fd);
+            return EXIT_FAILURE;
+        }
+        madvise((void *)trace, size, MADV_SEQUENTIAL);
+    }
+
+    long long counts[OP_COUNT] = { 0 };
+    long long totalNs[OP_COUNT] = { 0 };
+    long long histogram[OP_COUNT][BUCKETS] = { { 0 } };
+    long long verified = 0, mismatches = 0, rejected = 0;
+
+    MAGIC m = MAGICinitWithOptions(&options);
+    long long start = nowNs();
+    const char *line = trace, *end = trace + size;
+    for (long long lineNumber = 1; line < end; lineNumber++)
+    {
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol)
+            eol = end;
+        const char *p = line;
+        line = eol + 1;
+
+        while (p < eol && isBlank(*p))
+            p++;
+        if (p == eol || *p == '#')
+            continue;
+
+        // The record type is a single letter
+        char type = *p++;
+        if (p < eol && !isBlank(*p))
+            type = '?';
+        if (type == 'f' && atEnd(p, eol)) 
+        {
+            MAGICfreeze(m);
+            continue;
+        }
+        // Fields are checked here, as the library asserts on invalid arguments
+        int a, b, expected = 0;
+        int hasExpected = 0;
+        int valid = (type == 'a' || type == 'r' || type == 'm') &&
+                    parseInt(&p, eol, &a) && parseInt(&p, eol, &b);
+        if (valid && type == 'm') 
+        {
+            hasExpected = parseInt(&p, eol, &expected);
+            valid = (a == 0 || a == 1) && b >= 0 && (!hasExpected || expected >= -1);
+        }
+        else if (valid)
+            valid = a >= 0 && b > 0 && (long long)a + b <= INT_MAX;
+        if (!valid || !atEnd(p, eol))
+        {
+            if (++rejected <= MAX_REPORTED)
+                fprintf(stderr, "%s:%lld: malformed record\n", argv[optind], lineNumber);
+            continue;
+        }
+
+        enum Operation op;
+        int result = 0;
+        long long before = nowNs();
+        if (type == 'a')
+        {
+            op = OP_ADD;
+            MAGICadd(m, a, b);
+        }
+        else if (type == 'r')
+        {
+            op = OP_REMOVE;
+            MAGICremove(m, a, b);
+        }
+        else
+        {
+            op = OP_MAP;
+            result = MAGICmap(m, a ? STREAM_OUT_IN : STREAM_IN_OUT, b);
+        }
+        long long elapsed = nowNs() - before;
+
+        counts[op]++;
+        totalNs[op] += elapsed;
+        histogram[op][bucketOf(elapsed)]++;
+
+        if (verify && op == OP_MAP && hasExpected)
+        {
+            verified++;
+            if (result != expected && ++mismatches <= MAX_REPORTED)
+                fprintf(stderr, "%s:%lld: map(%d, %d) returned %d, expected %d\n",
+                        argv[optind], lineNumber, a, b, result, expected);
+        }
+    }
+    double seconds = (nowNs() - start) / 1e9;
+
+    MAGICStats stats;
+    MAGICgetStats(m, &stats);
+    MAGICdestroy(m);
+    if (size > 0)
+        munmap((void *)trace, size);
+    close(fd);
+
+    // === Report ===
+    long long total = counts[OP_ADD] + counts[OP_REMOVE] + counts[OP_MAP];
+    printf("records: %lld (add %lld, remove %lld, map %lld) in %.3f sec\n",
+           total, counts[OP_ADD], counts[OP_REMOVE], counts[OP_MAP], seconds);
+    printf("throughput: %.0f ops/sec\n", seconds > 0 ? total / seconds : 0.0);
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        if (counts[op])
+            printf("mean latency %s: %.1f ns\n", operationNames[op], (double)totalNs[op] / counts[op]);
+    }
+
+    printf("latency histogram (ns) %12s %12s %12s\n", "add", "remove", "map");
+    for (int i = 0; i < BUCKETS; i++)
+    {
+        if (!histogram[OP_ADD][i] && !histogram[OP_REMOVE][i] && !histogram[OP_MAP][i])
+            continue;
+        long long low = i ? 1LL << (i - 1) : 0;
+        printf("  [%9lld, %9lld) %12lld %12lld %12lld\n", low, 1LL << i,
+               histogram[OP_ADD][i], histogram[OP_REMOVE][i], histogram[OP_MAP][i]);
+    }
+
+    // The peak resident set also counts the pages of the trace read through the mapping
+    struct rusage resources;
+    getrusage(RUSAGE_SELF, &resources);
+    printf("peak memory: %ld KiB (including up to %zu KiB of mapped trace)\n",
+           resources.ru_maxrss, (size_t)((size + 1023) / 1024));
+    printf("cache pages filled: %lld, evicted: %lld, invalidated: %lld\n",
+           stats.pageFills, stats.pageEvictions, stats.pageInvalidations);
+    printf("edit log flushes: %lld\n", stats.logFlushes);
+
+    if (rejected)
+        printf("rejected: %lld malformed records\n", rejected);
+    if (verify)
+        printf("verified: %lld map results, %lld mismatches\n", verified, mismatches);
+    return rejected || mismatches ? EXIT_FAILURE : 0;
+}
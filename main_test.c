@@ -3,6 +3,7 @@
 #include "magic.h"
 #include <stdlib.h>
 #include <time.h>
+#include <limits.h>
 
 int main() 
 {
@@ -92,6 +93,187 @@ int main()
     MAGICdestroy(m);
     printf("------Test 5 passed------\n");
 
+    // TEST 6 : Edits in increasing output order (appended to the edit log)
+    m = MAGICinit();
+    for (int i = 0; i < 10; ++i) 
+    {
+        MAGICadd(m, 3 * i, 1);
+    }
+    MAGICremove(m, 30, 2);
+    for (int i = 0; i < 20; ++i) 
+    {
+        assert(MAGICmap(m, STREAM_IN_OUT, i) == i + i / 2 + 1);
+    }
+    assert(MAGICmap(m, STREAM_IN_OUT, 20) == -1);
+    assert(MAGICmap(m, STREAM_IN_OUT, 21) == -1);
+    assert(MAGICmap(m, STREAM_IN_OUT, 22) == 30);
+    assert(MAGICmap(m, STREAM_IN_OUT, 23) == 31);
+    MAGICdestroy(m);
+    printf("------Test 6 passed------\n");
+
+    // TEST 7 : Bounded cache (no cache, then a single page evicted on every miss)
+    size_t budgets[] = { 0, 5000 };
+    for (int b = 0; b < 2; ++b) 
+    {
+        MAGICOptions options = { budgets[b] };
+        m = MAGICinitWithOptions(&options);
+        MAGICremove(m, 3, 2);
+        MAGICremove(m, 4, 3);
+        MAGICadd(m, 4, 2);
+        MAGICadd(m, 5000, 3);
+        for (int i = 0; i < 3; ++i) 
+        {
+            assert(MAGICmap(m, STREAM_IN_OUT, 5) == 3);
+            assert(MAGICmap(m, STREAM_IN_OUT, 7) == -1);
+            assert(MAGICmap(m, STREAM_IN_OUT, 5002) == 4999);
+            assert(MAGICmap(m, STREAM_IN_OUT, 5003) == 5003);
+            assert(MAGICmap(m, STREAM_OUT_IN, 4999) == 5002);
+            assert(MAGICmap(m, STREAM_OUT_IN, 5000) == -1);
+            assert(MAGICmap(m, STREAM_OUT_IN, 3) == 5);
+        }
+        MAGICdestroy(m);
+    }
+    printf("------Test 7 passed------\n");
+
+    // TEST 8 : Split and join (brief example)
+    int brief[] = { 0, 1, 2, -1, -1, 3, -1, -1, -1, 6, 7, 8, 12, 13, 14 };
+    for (int split = 0; split < 15; ++split) 
+    {
+        MAGIC left, right;
+        m = MAGICinit();
+        MAGICremove(m, 3, 2);
+        MAGICremove(m, 4, 3);
+        MAGICadd(m, 4, 2);
+        MAGICadd(m, 9, 3);
+        MAGICsplit(m, split, &left, &right);
+
+        // The right part starts where the output of the left part ends
+        int leftLength = split;
+        for (int i = 0; i < split; ++i) 
+        {
+            assert(MAGICmap(left, STREAM_IN_OUT, i) == brief[i]);
+            if (brief[i] != -1)
+                leftLength = brief[i] + 1;
+        }
+        for (int i = split; i < 15; ++i) 
+        {
+            int expected = brief[i] == -1 ? -1 : brief[i] - leftLength;
+            assert(MAGICmap(right, STREAM_IN_OUT, i - split) == expected);
+        }
+
+        MAGICjoin(left, right, split);
+        for (int i = 0; i < 15; ++i) 
+        {
+            assert(MAGICmap(left, STREAM_IN_OUT, i) == brief[i]);
+        }
+        MAGICdestroy(left);
+    }
+
+    // Chunks built separately, then joined
+    m = MAGICinit();
+    MAGIC chunk = MAGICinit();
+    MAGICadd(m, 0, 2);
+    MAGICremove(chunk, 0, 3);
+    MAGICjoin(m, chunk, 10);
+    assert(MAGICmap(m, STREAM_IN_OUT, 9) == 11);
+    assert(MAGICmap(m, STREAM_IN_OUT, 10) == -1);
+    assert(MAGICmap(m, STREAM_IN_OUT, 12) == -1);
+    assert(MAGICmap(m, STREAM_IN_OUT, 13) == 12);
+    MAGICdestroy(m);
+    printf("------Test 8 passed------\n");
+
+    // TEST 9 : Frozen mapping (brief example), thawed by the next edit
+    int briefOut[] = { 0, 1, 2, 5, -1, -1, 9, 10, 11, -1, -1, -1, 12, 13, 14 };
+    m = MAGICinit();
+    MAGICremove(m, 3, 2);
+    MAGICremove(m, 4, 3);
+    MAGICadd(m, 4, 2);
+    MAGICadd(m, 9, 3);
+    MAGICfreeze(m);
+    for (int i = 0; i < 15; ++i) 
+    {
+        assert(MAGICmap(m, STREAM_IN_OUT, i) == brief[i]);
+        assert(MAGICmap(m, STREAM_OUT_IN, i) == briefOut[i]);
+    }
+    MAGICadd(m, 0, 1);
+    assert(MAGICmap(m, STREAM_IN_OUT, 0) == 1);
+    assert(MAGICmap(m, STREAM_OUT_IN, 0) == -1);
+    assert(MAGICmap(m, STREAM_OUT_IN, 4) == 5);
+    MAGICdestroy(m);
+    // A removal inside another one: freezing does not change the answers
+    m = MAGICinit();
+    MAGICremove(m, 1, 1);
+    MAGICremove(m, 3, 2);
+    MAGICremove(m, 2, 3);
+    int unfrozen = MAGICmap(m, STREAM_OUT_IN, 0);
+    MAGICfreeze(m);
+    assert(MAGICmap(m, STREAM_OUT_IN, 0) == unfrozen);
+    MAGICdestroy(m);
+    printf("------Test 9 passed------\n");
+
+    // TEST 10 : Batches of queries in any order (brief example)
+    m = MAGICinit();
+    MAGICremove(m, 3, 2);
+    MAGICremove(m, 4, 3);
+    MAGICadd(m, 4, 2);
+    MAGICadd(m, 9, 3);
+    for (int frozen = 0; frozen < 2; ++frozen) 
+    {
+        if (frozen)
+            MAGICfreeze(m);
+        int positions[40], results[40];
+        for (int i = 0; i < 40; ++i)
+            positions[i] = (i * 7) % 15;
+        MAGICmapBatch(m, STREAM_IN_OUT, positions, results, 40);
+        for (int i = 0; i < 40; ++i)
+            assert(results[i] == brief[positions[i]]);
+        // Mapped in place
+        MAGICmapBatch(m, STREAM_OUT_IN, positions, positions, 40);
+        for (int i = 0; i < 40; ++i)
+            assert(positions[i] == briefOut[(i * 7) % 15]);
+    }
+    MAGICdestroy(m);
+    printf("------Test 10 passed------\n");
+
+    // TEST 11 : Positions near INT_MAX (the last cache page)
+    m = MAGICinit();
+    assert(MAGICmap(m, STREAM_IN_OUT, INT_MAX - 5) == INT_MAX - 5);
+    assert(MAGICmap(m, STREAM_OUT_IN, INT_MAX - 5) == INT_MAX - 5);
+    MAGICadd(m, 5, 1);
+    assert(MAGICmap(m, STREAM_IN_OUT, INT_MAX - 5) == INT_MAX - 4);
+    assert(MAGICmap(m, STREAM_OUT_IN, INT_MAX - 5) == INT_MAX - 6);
+    // No output fits past INT_MAX
+    assert(MAGICmap(m, STREAM_IN_OUT, INT_MAX) == -1);
+    MAGICremove(m, 10, 20);
+    assert(MAGICmap(m, STREAM_IN_OUT, INT_MAX - 5) == INT_MAX - 24);
+    assert(MAGICmap(m, STREAM_OUT_IN, INT_MAX - 5) == -1);
+    MAGICdestroy(m);
+    // A removal running past INT_MAX stops there
+    m = MAGICinit();
+    MAGICremove(m, 10, INT_MAX - 5);
+    assert(MAGICmap(m, STREAM_IN_OUT, 9) == 9);
+    assert(MAGICmap(m, STREAM_IN_OUT, 11) == -1);
+    assert(MAGICmap(m, STREAM_IN_OUT, INT_MAX) == 10);
+    assert(MAGICmap(m, STREAM_OUT_IN, 10) == INT_MAX);
+    MAGICdestroy(m);
+    printf("------Test 11 passed------\n");
+
+    // TEST 12 : Burst of edits in decreasing order (before the logged ones)
+    m = MAGICinit();
+    for (int i = 5000; i >= 0; --i) 
+    {
+        MAGICadd(m, i, 1);
+    }
+    for (int i = 0; i <= 5000; ++i) 
+    {
+        assert(MAGICmap(m, STREAM_IN_OUT, i) == 2 * i + 1);
+        assert(MAGICmap(m, STREAM_OUT_IN, 2 * i + 1) == i);
+        assert(MAGICmap(m, STREAM_OUT_IN, 2 * i) == -1);
+    }
+    assert(MAGICmap(m, STREAM_IN_OUT, 5001) == 10002);
+    MAGICdestroy(m);
+    printf("------Test 12 passed------\n");
+
     //===================================================
     //================= OUT -> IN TESTS =================
     //===================================================
@@ -127,5 +309,22 @@ int main()
     MAGICdestroy(m);
     printf("------Test B passed------\n");
 
+    // TEST C: Edits in increasing output order + OUT -> IN mapping
+    m = MAGICinit();
+    for (int i = 0; i < 10; ++i) 
+    {
+        MAGICadd(m, 3 * i, 1);
+    }
+    assert(MAGICmap(m, STREAM_OUT_IN, 0) == -1);
+    assert(MAGICmap(m, STREAM_OUT_IN, 1) == 0);
+    assert(MAGICmap(m, STREAM_OUT_IN, 2) == 1);
+    assert(MAGICmap(m, STREAM_OUT_IN, 3) == -1);
+    assert(MAGICmap(m, STREAM_OUT_IN, 4) == 2);
+    assert(MAGICmap(m, STREAM_OUT_IN, 29) == 19);
+    assert(MAGICmap(m, STREAM_OUT_IN, 30) == 20);
+
+    MAGICdestroy(m);
+    printf("------Test C passed------\n");
+
     return 0;
 }
\ No newline at end of file
@@ -2,37 +2,117 @@
 // Code based on the implementation of the INFO0027-2 red-black tree
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <stdint.h>
 #include "magic.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define FROZEN_AVX2 1
+#endif
+
 // Constants for red-black tree
 #define RED 1
 #define BLACK 0
 
+// Number of positions held by one page of the mapping cache
+#define CACHE_PAGE_SIZE 1024
+// Bounds on the number of buckets of the page hash table
+#define CACHE_MIN_BUCKETS 16
+#define CACHE_MAX_BUCKETS (1 << 20)
+// Number of edits logged before they are merged into the tree
+#define EDIT_LOG_CAPACITY 4096
+// Number of keys per block of a frozen search tree (one cache line)
+#define FROZEN_BLOCK 16
+// Number of queries of MAGICmapBatch whose searches are interleaved
+#define BATCH_GROUP 16
+// Queries per page of a batch from which filling the pages costs less than descending
+#define BATCH_DENSE 32
+
 /// @brief Type for the MAGIC ADT node
 typedef struct Node 
 {
     int pos;                              // position in input stream
     int delta;                           // +len for add, -len for remove
     int totalDelta;                     // cumulative delta
+    int maxEnd;                        // end of the furthest removal in the subtree (0 if none)
+    int shift;                        // position shift not yet applied to the children
     struct Node *left, *right, *parent;// child nodes and parent
     int color;                        // RED or BLACK (for red-black tree)
 } Node;
 
+/// @brief Sentinel node, shared by every instance so that subtrees can move
+/// between them. It is never written after initialization.
+static Node nilNode = { .color = BLACK };
+
+/// @brief Edit logged but not yet merged into the tree
+typedef struct LoggedEdit 
+{
+    int pos;        // position in input stream
+    int delta;      // +len for add, -len for remove
+    int cumulative; // sum of the deltas of the log up to this edit
+    int maxEnd;     // end of the furthest logged removal up to this edit (0 if none)
+} LoggedEdit;
+
+/// @brief Page of the mapping cache, covering CACHE_PAGE_SIZE positions
+typedef struct Page 
+{
+    int direction;                 // STREAM_IN_OUT or STREAM_OUT_IN
+    int index;                     // first position is index * CACHE_PAGE_SIZE
+    struct Page *next;             // next page in the same hash bucket
+    struct Page *newer, *older;    // neighbours in the LRU list
+    int map[CACHE_PAGE_SIZE];      // mapped positions (-1 if none)
+} Page;
+
+/// @brief Static search tree over sorted keys, stored as blocks of FROZEN_BLOCK keys
+/// where block k has children k * (FROZEN_BLOCK + 1) + i + 1 (0 <= i <= FROZEN_BLOCK)
+typedef struct FrozenTree 
+{
+    void *memory;  // allocation holding the keys
+    int *keys;     // keys aligned on a cache line (INT_MAX after the last one)
+    struct FrozenSegment *segments; // segment before each key, then the one after every key
+    int blocks;    // number of blocks
+} FrozenTree;
+
+/// @brief Mapping of the positions between two keys of a frozen tree
+typedef struct FrozenSegment 
+{
+    int shift; // value added to the position
+    int bound; // IN -> OUT: end of the removed positions, OUT -> IN: end of the segment
+} FrozenSegment;
+
+/// @brief Flattened copy of the mapping, dropped by the next edit
+typedef struct Frozen 
+{
+    FrozenTree trees[2];                // search tree of each direction
+    bool outIn;                         // the OUT -> IN tree is built (not when removals overlap)
+    int (*search)(const FrozenTree *, int); // search implementation for this processor
+    void (*searchBatch)(const FrozenTree *, const int *, int *, int); // same, for a group of positions
+} Frozen;
+
 struct magic 
 {
     Node *root;         // root of the red-black tree
     Node *NIL;          // sentinel node
-    int max_input_pos;  // max position in input stream
-    int *outMapping;    // output -> input cache
-    int outMappingSize; // cache size
-    int *inMapping;     // input -> output cache
-    int inMappingSize;  // input -> output cache size
-    int cacheValid;     // if 1, cache is valid
-    int cacheDirtyFrom; // First position to update in cache
+    Page **buckets;     // hash table of the cached pages
+    int bucketCount;    // number of buckets (power of two)
+    Page *newest;       // most recently used page
+    Page *oldest;       // least recently used page (evicted first)
+    size_t cacheUsed;   // bytes used by the cached pages
+    size_t cacheBudget; // max bytes used by the cached pages
+    int tailFrom;       // first input position past every node, logged edit and removed range
+    LoggedEdit *log;    // edits past every node not yet merged into the tree (ascending input positions)
+    int logCount;       // number of logged edits
+    int logCapacity;    // capacity of the log
+    int staleFrom;      // first input position edited since the pages were last checked (INT_MAX if none)
+    bool overlapping;   // a removal starts inside another one (see lowerBoundInput)
+    MAGICStats stats;   // work counters reported by MAGICgetStats
+    Frozen *frozen;     // flattened copy of the mapping (NULL if not frozen since the last edit)
 };
 
 //=============================================================================
@@ -45,7 +125,7 @@ struct magic
 /// @param delta Delta value (+len for add, -len for remove)
 /// @return Pointer to the new node
 static Node* createNode(MAGIC m, int pos, int delta);
-/// @brief Update the total delta value of a node and its ancestors.
+/// @brief Update the total delta and removal end of a node from its children.
 /// @param node Pointer to the node to update
 static void updateTotalDelta(Node *node);
 /// @brief Rotate the tree to the left around a node.
@@ -56,10 +136,20 @@ static void rotateLeft(MAGIC m, Node *x);
 /// @param m Pointer to the MAGIC instance
 /// @param y Pointer to the node to rotate
 static void rotateRight(MAGIC m, Node *y);
+/// @brief Shift the positions of a whole subtree.
+/// @param node Pointer to the root of the subtree
+/// @param NIL Pointer to the NIL node
+/// @param shift Value added to every position
+static void shiftSubtree(Node *node, Node *NIL, int shift);
+/// @brief Apply the pending shift of a node to its children.
+/// @param node Pointer to the node
+/// @param NIL Pointer to the NIL node
+static void pushShift(Node *node, Node *NIL);
 /// @brief Fix the red-black tree after insertion.
 /// @param m Pointer to the MAGIC instance
 /// @param z Pointer to the newly inserted node
-static void fixInsert(MAGIC m, Node *z);
+/// @return 1 if the black height of the tree grew, 0 otherwise
+static int fixInsert(MAGIC m, Node *z);
 /// @brief Insert a delta into the red-black tree.
 /// @param m Pointer to the MAGIC instance
 /// @param pos Position in the input stream
@@ -69,30 +159,272 @@ static void insertDelta(MAGIC m, int pos, int delta);
 /// @param node Pointer to the current node
 /// @param NIL Pointer to the NIL node
 /// @param pos Position to check
+/// @param removedEnd Set to the end of the furthest removal starting at or before 'pos' (0 if none)
+/// @param nextNode Set to the first node after 'pos' (NIL if none)
 /// @return Cumulative delta value
-static int getCumulativeDelta(Node *node, Node *NIL, int pos);
-/// @brief Destroy the red-black tree.
+static int getCumulativeDelta(Node *node, Node *NIL, int pos, int *removedEnd, Node **nextNode);
+/// @brief Find the segment of input positions, between two nodes, whose outputs reach an output position.
 /// @param node Pointer to the current node
 /// @param NIL Pointer to the NIL node
-static void destroyTree(Node *node, Node *NIL);
-/// @brief Check if a position is actually removed.
+/// @param pos Position in the output stream
+/// @param removedEnd Set to the end of the furthest removal up to the segment (0 if none)
+/// @param lastNode Set to the node starting the segment (NIL if it starts at 0)
+/// @param nextNode Set to the node ending the segment (NIL if none)
+/// @return Cumulative delta value of the segment
+static int findOutputSegment(Node *node, Node *NIL, int pos, int *removedEnd, Node **lastNode, Node **nextNode);
+/// @brief Get the next node in position order.
 /// @param node Pointer to the current node
 /// @param NIL Pointer to the NIL node
-/// @param pos Position to check
-/// @return 1 if removed, 0 otherwise
-static int IsRemoved(Node *node, Node *NIL, int pos);
-/// @brief Mark removed positions in the cache.
+/// @return Pointer to the successor, or NIL if none
+static Node* successor(Node *node, Node *NIL);
+/// @brief Get the number of black nodes on a path from a node to the leaves.
+/// @param node Pointer to the root of the subtree
+/// @param NIL Pointer to the NIL node
+/// @return Black height of the subtree
+static int blackHeight(Node *node, Node *NIL);
+/// @brief Get the last node in position order.
+/// @param node Pointer to the root of the subtree
+/// @param NIL Pointer to the NIL node
+/// @return Pointer to the last node, or NIL if the subtree is empty
+static Node* lastNode(Node *node, Node *NIL);
+/// @brief Join two red-black trees around a middle node.
+/// @param m Pointer to the MAGIC instance used for the rotations
+/// @param left Pointer to the root of the tree holding the smaller positions
+/// @param leftHeight Black height of 'left'
+/// @param mid Pointer to a detached node positioned between both trees
+/// @param right Pointer to the root of the tree holding the larger positions
+/// @param rightHeight Black height of 'right'
+/// @param height Set to the black height of the joined tree
+/// @return Pointer to the root of the joined tree
+static Node* joinTrees(MAGIC m, Node *left, int leftHeight, Node *mid, Node *right, int rightHeight, int *height);
+/// @brief Split a red-black tree at a position.
+/// @param m Pointer to the MAGIC instance used for the rotations
+/// @param node Pointer to the root of the tree
+/// @param nodeHeight Black height of the tree
+/// @param pos First position of the right tree
+/// @param left Set to the root of the tree holding positions before 'pos'
+/// @param leftHeight Set to the black height of 'left'
+/// @param right Set to the root of the tree holding positions from 'pos'
+/// @param rightHeight Set to the black height of 'right'
+static void splitTree(MAGIC m, Node *node, int nodeHeight, int pos, Node **left, int *leftHeight, Node **right, int *rightHeight);
+/// @brief Find the node at a position.
+/// @param m Pointer to the MAGIC instance
+/// @param pos Position in the input stream
+/// @return Pointer to the node, or NIL if none
+static Node* findNode(MAGIC m, int pos);
+/// @brief Add bytes before the first input position kept from 'pos'.
+/// @param m Pointer to the MAGIC instance
+/// @param pos Position in the input stream
+/// @param length Number of bytes to add
+static void insertAddition(MAGIC m, int pos, int length);
+/// @brief Shorten the removals that run past a position.
+/// @param m Pointer to the MAGIC instance
+/// @param pos Position where removals must stop
+/// @return Number of removed positions cut off
+static int cutRemovals(MAGIC m, int pos);
+/// @brief Recompute 'tailFrom' from the tree.
+/// @param m Pointer to the MAGIC instance
+static void resetTailFrom(MAGIC m);
+/// @brief Destroy the red-black tree.
 /// @param node Pointer to the current node
 /// @param NIL Pointer to the NIL node
-/// @param removed Pointer to the removed positions array
-/// @param maxInput Maximum input position
-static void markRemovedPositions(Node *node, Node *NIL, bool *removed, int maxInput);
-/// @brief Update the local cache
+static void destroyTree(Node *node, Node *NIL);
+/// @brief Skip removed positions starting from an input position.
+/// @param m Pointer to the MAGIC instance
+/// @param pos Position in the input stream
+/// @param outPos Set to the output position of the returned input position
+/// @return First input position at or after 'pos' that is not removed
+static int firstMapped(MAGIC m, int pos, int *outPos);
+/// @brief Find the first input position mapped at or after an output position.
+/// @param m Pointer to the MAGIC instance
+/// @param pos Position in the output stream
+/// @param outPos Set to the output position of the returned input position
+/// @return Input position
+static int lowerBoundInput(MAGIC m, int pos, int *outPos);
+/// @brief Map an input position by walking the tree.
+/// @param m Pointer to the MAGIC instance
+/// @param pos Position in the input stream
+/// @return Output position, or -1 if removed
+static int mapInOut(MAGIC m, int pos);
+/// @brief Map an output position by walking the tree.
+/// @param m Pointer to the MAGIC instance
+/// @param pos Position in the output stream
+/// @return Input position, or -1 if the byte was added
+static int mapOutIn(MAGIC m, int pos);
+/// @brief Get the hash bucket of a page.
+/// @param m Pointer to the MAGIC instance
+/// @param direction Direction of the page
+/// @param index Index of the page
+/// @return Pointer to the head of the bucket
+static Page** pageBucket(MAGIC m, int direction, int index);
+/// @brief Unlink a page from the cache and free it.
+/// @param m Pointer to the MAGIC instance
+/// @param page Pointer to the page to drop
+static void dropPage(MAGIC m, Page *page);
+/// @brief Fill a page with the input -> output mapping.
+/// @param m Pointer to the MAGIC instance
+/// @param page Pointer to the page to fill
+static void fillInPage(MAGIC m, Page *page);
+/// @brief Fill a page with the output -> input mapping.
+/// @param m Pointer to the MAGIC instance
+/// @param page Pointer to the page to fill
+static void fillOutPage(MAGIC m, Page *page);
+/// @brief Get a cached page, filling it on a miss and evicting old pages if needed.
+/// @param m Pointer to the MAGIC instance
+/// @param direction Direction of mapping
+/// @param index Index of the page
+/// @return Pointer to the page, or NULL if it does not fit in the budget
+static Page* getPage(MAGIC m, int direction, int index);
+/// @brief Get a cached page without filling it if it is missing.
+/// @param m Pointer to the MAGIC instance
+/// @param direction Direction of the page
+/// @param index Index of the page
+/// @return Pointer to the page, or NULL if it is not cached
+static Page* findPage(MAGIC m, int direction, int index);
+/// @brief Drop the cached pages affected by an edit at an input position.
+/// @param m Pointer to the MAGIC instance
+/// @param pos Position in the input stream
+static void invalidatePages(MAGIC m, int pos);
+/// @brief Free the frozen copy of an instance, which an edit makes stale.
+/// @param m Pointer to the MAGIC instance
+static void thaw(MAGIC m);
+/// @brief Move 'tailFrom' past a node at 'pos' holding 'delta'.
+/// @param m Pointer to the MAGIC instance
+/// @param pos Position of the node in the input stream
+/// @param delta Delta value of the node
+static void updateTailFrom(MAGIC m, int pos, int delta);
+/// @brief Get the cumulative delta value up to a given position, logged edits included.
+/// @param m Pointer to the MAGIC instance
+/// @param pos Position to check
+/// @param removedEnd Set to the end of the furthest removal starting at or before 'pos' (0 if none)
+/// @return Cumulative delta value
+static int getEditedDelta(MAGIC m, int pos, int *removedEnd);
+/// @brief Log an edit past every node, merging the log into the tree first if it is full,
+/// or insert it into the tree.
+/// @param m Pointer to the MAGIC instance
+/// @param pos Position in the input stream
+/// @param delta Delta value (+len for add, -len for remove)
+static void logEdit(MAGIC m, int pos, int delta);
+/// @brief Flag the instance if the removal at an input position covers the start of another one.
+/// @param m Pointer to the MAGIC instance
+/// @param pos Position in the input stream
+static void checkOverlap(MAGIC m, int pos);
+/// @brief Build a subtree of a balanced red-black tree from nodes in position order.
+/// @param nodes Nodes in position order
+/// @param count Number of nodes
+/// @param depth Depth of the root of the subtree
+/// @param redDepth Depth of the nodes colored red (the deepest level, -1 for none)
+/// @param parent Parent of the root of the subtree
+/// @param NIL Pointer to the NIL node
+/// @return Pointer to the root of the subtree
+static Node* buildTree(Node **nodes, int count, int depth, int redDepth, Node *parent, Node *NIL);
+/// @brief Build a balanced red-black tree from nodes in position order.
+/// @param m Pointer to the MAGIC instance
+/// @param nodes Nodes in position order
+/// @param count Number of nodes
+/// @param height Set to the black height of the tree
+/// @return Pointer to the root of the tree
+static Node* buildBalanced(MAGIC m, Node **nodes, int count, int *height);
+/// @brief Merge the logged edits into the red-black tree and drop the pages they change.
+/// @param m Pointer to the MAGIC instance
+static void flushLog(MAGIC m);
+/// @brief Count the keys of a frozen block that are at most a position.
+/// @param keys Pointer to the keys of the block
+/// @param pos Position to look up
+/// @return Number of keys <= 'pos'
+static inline int frozenRankScalar(const int *keys, int pos);
+/// @brief Find the slot of the first key of a frozen tree after a position.
+/// @param tree Pointer to the frozen tree
+/// @param pos Position to look up
+/// @return Slot of the first key > 'pos', or the number of slots if none
+static int frozenSearchScalar(const FrozenTree *tree, int pos);
+/// @brief Find the slots of the first keys of a frozen tree after several positions,
+/// interleaving the searches.
+/// @param tree Pointer to the frozen tree
+/// @param pos Positions to look up
+/// @param slots Set to the slot of each position, like frozenSearchScalar
+/// @param count Number of positions (at most BATCH_GROUP)
+static void frozenSearchBatchScalar(const FrozenTree *tree, const int *pos, int *slots, int count);
+#ifdef FROZEN_AVX2
+/// @brief Count the keys of a frozen block that are at most a position, using AVX2.
+/// @param keys Pointer to the keys of the block (aligned on a cache line)
+/// @param pos Position to look up, in every lane
+/// @return Number of keys <= 'pos'
+static inline int frozenRankAvx2(const int *keys, __m256i pos);
+/// @brief Find the slot of the first key of a frozen tree after a position, using AVX2.
+/// @param tree Pointer to the frozen tree
+/// @param pos Position to look up
+/// @return Slot of the first key > 'pos', or the number of slots if none
+static int frozenSearchAvx2(const FrozenTree *tree, int pos);
+/// @brief Find the slots of the first keys of a frozen tree after several positions,
+/// interleaving the searches, using AVX2.
+/// @param tree Pointer to the frozen tree
+/// @param pos Positions to look up
+/// @param slots Set to the slot of each position, like frozenSearchAvx2
+/// @param count Number of positions (at most BATCH_GROUP)
+static void frozenSearchBatchAvx2(const FrozenTree *tree, const int *pos, int *slots, int count);
+#endif
+/// @brief Map a position with the segment found in a frozen tree.
+/// @param segment Segment following the last key <= 'pos'
+/// @param direction Direction of mapping
+/// @param pos Position to map
+/// @return Mapped position, or -1 if none
+static inline int frozenMap(FrozenSegment segment, int direction, int pos);
+/// @brief Get the cumulative delta values of several positions, descending the tree
+/// for all of them in lockstep and prefetching the next nodes.
+/// @param m Pointer to the MAGIC instance
+/// @param pos Positions to check
+/// @param count Number of positions (at most BATCH_GROUP)
+/// @param cumulative Set to the cumulative delta value of each position
+/// @param removedEnd Set to the end of the furthest removal starting at or before each position (0 if none)
+static void getCumulativeDeltas(MAGIC m, const int *pos, int count, int *cumulative, int *removedEnd);
+/// @brief Find the segments of input positions whose outputs reach several output positions,
+/// descending the tree for all of them in lockstep like getCumulativeDeltas.
 /// @param m Pointer to the MAGIC instance
-static void updateCacheLocal(MAGIC m);
-/// @brief Invalidate the cache to force a recalculation.
+/// @param pos Positions in the output stream
+/// @param count Number of positions (at most BATCH_GROUP)
+/// @param cumulative Set to the cumulative delta value of each segment
+/// @param removedEnd Set to the end of the furthest removal up to each segment (0 if none)
+/// @param lastNode Set to the node starting each segment (NIL if it starts at 0)
+/// @param nextNode Set to the node ending each segment (NIL if none)
+static void findOutputSegments(MAGIC m, const int *pos, int count, int *cumulative, int *removedEnd, Node **lastNode, Node **nextNode);
+/// @brief Map several input positions by walking the tree.
 /// @param m Pointer to the MAGIC instance
-static void invalidateCache(MAGIC m);
+/// @param pos Positions in the input stream
+/// @param result Set to the output positions, or -1 if removed
+/// @param count Number of positions (at most BATCH_GROUP)
+static void mapInOutBatch(MAGIC m, const int *pos, int *result, int count);
+/// @brief Map several output positions by walking the tree.
+/// @param m Pointer to the MAGIC instance
+/// @param pos Positions in the output stream
+/// @param result Set to the input positions, or -1 if the byte was added
+/// @param count Number of positions (at most BATCH_GROUP)
+static void mapOutInBatch(MAGIC m, const int *pos, int *result, int count);
+/// @brief Map several output positions by running the binary search of lowerBoundInput
+/// for all of them, needed once removals overlap.
+/// @param m Pointer to the MAGIC instance
+/// @param pos Positions in the output stream
+/// @param result Set to the input positions, or -1 if the byte was added
+/// @param count Number of positions (at most BATCH_GROUP)
+static void bisectOutInBatch(MAGIC m, const int *pos, int *result, int count);
+/// @brief Fill the blocks of a frozen tree in key order.
+/// @param tree Pointer to the frozen tree
+/// @param sorted Keys in ascending order
+/// @param segments Segment before each key, then the one after every key
+/// @param count Number of keys
+/// @param block Index of the current block
+/// @param next Index of the next key to place
+static void fillFrozenBlocks(FrozenTree *tree, const int *sorted, const FrozenSegment *segments, int count, int block, int *next);
+/// @brief Build a frozen tree over sorted keys.
+/// @param tree Pointer to the frozen tree
+/// @param sorted Keys in ascending order
+/// @param segments Segment before each key, then the one after every key ('count' + 1 entries)
+/// @param count Number of keys
+/// @return 1 on success, 0 if out of memory
+static int buildFrozenTree(FrozenTree *tree, const int *sorted, const FrozenSegment *segments, int count);
+/// @brief Free the frozen copy of the mapping.
+/// @param frozen Pointer to the frozen copy (may be NULL)
+static void destroyFrozen(Frozen *frozen);
 
 static Node* createNode(MAGIC m, int pos, int delta) 
 {
@@ -103,6 +435,8 @@ static Node* createNode(MAGIC m, int pos, int delta)
     node->pos = pos;
     node->delta = delta;
     node->totalDelta = delta;
+    node->maxEnd = delta < 0 ? pos - delta : 0;
+    node->shift = 0;
     node->left = node->right = node->parent = m->NIL;
     node->color = RED;
     return node;
@@ -113,8 +447,37 @@ static void updateTotalDelta(Node *node)
     if (node) 
     {
         node->totalDelta = node->delta;
-        if (node->left) node->totalDelta += node->left->totalDelta;
-        if (node->right) node->totalDelta += node->right->totalDelta;
+        node->maxEnd = node->delta < 0 ? node->pos - node->delta : 0;
+        if (node->left) 
+        {
+            node->totalDelta += node->left->totalDelta;
+            if (node->left->maxEnd > node->maxEnd) node->maxEnd = node->left->maxEnd;
+        }
+        if (node->right) 
+        {
+            node->totalDelta += node->right->totalDelta;
+            if (node->right->maxEnd > node->maxEnd) node->maxEnd = node->right->maxEnd;
+        }
+    }
+}
+
+static void shiftSubtree(Node *node, Node *NIL, int shift) 
+{
+    if (node == NIL || shift == 0)
+        return;
+    node->pos += shift;
+    if (node->maxEnd)
+        node->maxEnd += shift;
+    node->shift += shift;
+}
+
+static void pushShift(Node *node, Node *NIL) 
+{
+    if (node->shift) 
+    {
+        shiftSubtree(node->left, NIL, node->shift);
+        shiftSubtree(node->right, NIL, node->shift);
+        node->shift = 0;
     }
 }
 
@@ -122,6 +485,8 @@ static void rotateLeft(MAGIC m, Node *x)
 {
     assert(m && x);
 
+    pushShift(x, m->NIL);
+    pushShift(x->right, m->NIL);
     Node *y = x->right;
     x->right = y->left;
     if (y->left != m->NIL)
@@ -145,6 +510,8 @@ static void rotateRight(MAGIC m, Node *y)
 {
     assert(m && y);
 
+    pushShift(y, m->NIL);
+    pushShift(y->left, m->NIL);
     Node *x = y->left;
     y->left = x->right;
     if (x->right != m->NIL)
@@ -164,7 +531,7 @@ static void rotateRight(MAGIC m, Node *y)
     updateTotalDelta(x);
 }
 
-static void fixInsert(MAGIC m, Node *z) 
+static int fixInsert(MAGIC m, Node *z) 
 {
     assert(m && z);
 
@@ -216,21 +583,23 @@ static void fixInsert(MAGIC m, Node *z)
         }
     }
 
+    // A red root can only come from recoloring the path up to it
+    int grew = m->root->color == RED;
     m->root->color = BLACK;
+    return grew;
 }
 
 static void insertDelta(MAGIC m, int pos, int delta) 
 {
     assert(m && pos >= 0 && delta != 0);
 
-    // Check if the position is valid
-    if (pos > m->max_input_pos)
-        m->max_input_pos = pos;
+    updateTailFrom(m, pos, delta);
     Node *x = m->root, *y = m->NIL;
 
     // Find the position to insert
     while (x != m->NIL) 
     {
+        pushShift(x, m->NIL);
         y = x;
         if (pos < x->pos)
             x = x->left;
@@ -239,6 +608,7 @@ static void insertDelta(MAGIC m, int pos, int delta)
         else 
         {
             x->delta += delta;
+            updateTailFrom(m, x->pos, x->delta);
             while (x != m->NIL) 
             {
                 updateTotalDelta(x);
@@ -266,338 +636,1553 @@ static void insertDelta(MAGIC m, int pos, int delta)
     }
 }
 
-static int getCumulativeDelta(Node *node, Node *NIL, int pos) 
+static int getCumulativeDelta(Node *node, Node *NIL, int pos, int *removedEnd, Node **nextNode) 
 {
     int sum = 0;
+    int end = 0;
+    Node *next = NIL;
     while (node != NIL) 
     {
-        if (pos < node->pos)
+        pushShift(node, NIL);
+        if (pos < node->pos) 
+        {
+            next = node;
             node = node->left;
+        }
         else 
         {
+            // The node and its whole left subtree start at or before 'pos'
             sum += node->delta + node->left->totalDelta;
+            if (node->left->maxEnd > end)
+                end = node->left->maxEnd;
+            if (node->delta < 0 && node->pos - node->delta > end)
+                end = node->pos - node->delta;
             node = node->right;
         }
     }
+    *removedEnd = end;
+    *nextNode = next;
     return sum;
 }
 
-static void destroyTree(Node *node, Node *NIL) 
+static int findOutputSegment(Node *node, Node *NIL, int pos, int *removedEnd, Node **lastNode, Node **nextNode) 
 {
-    if (node == NIL) return;
-    destroyTree(node->left, NIL);
-    destroyTree(node->right, NIL);
-    free(node);
+    int sum = 0;
+    int end = 0;
+    Node *last = NIL, *next = NIL;
+    while (node != NIL) 
+    {
+        pushShift(node, NIL);
+        // Output of the first input position at or after the node that is not removed
+        // before it, without its own delta (non-decreasing in position order, even
+        // when bytes were added inside a removed range)
+        int before = sum + node->left->totalDelta;
+        int endBefore = node->left->maxEnd > end ? node->left->maxEnd : end;
+        int first = node->pos > endBefore ? node->pos : endBefore;
+        if ((long long)first + before > pos) 
+        {
+            next = node;
+            node = node->left;
+        }
+        else 
+        {
+            sum = before + node->delta;
+            end = endBefore;
+            if (node->delta < 0 && node->pos - node->delta > end)
+                end = node->pos - node->delta;
+            last = node;
+            node = node->right;
+        }
+    }
+    *removedEnd = end;
+    *lastNode = last;
+    *nextNode = next;
+    return sum;
 }
 
-static void invalidateCache(MAGIC m) 
+static Node* successor(Node *node, Node *NIL) 
 {
-    m->cacheValid = 0;
-    m->cacheDirtyFrom = 0;
+    // Nodes above 'node' have no pending shift, those below may have one
+    if (node->right != NIL) 
+    {
+        pushShift(node, NIL);
+        node = node->right;
+        while (node->left != NIL) 
+        {
+            pushShift(node, NIL);
+            node = node->left;
+        }
+        return node;
+    }
+    while (node->parent != NIL && node == node->parent->right)
+        node = node->parent;
+    return node->parent;
 }
 
-static int IsRemoved(Node *node, Node *NIL, int pos) 
+static int blackHeight(Node *node, Node *NIL) 
 {
-    if (node == NIL)
-        return 0;
-        
-    // Check if the current node is a removal
-    if (node->delta < 0) {
-        int start = node->pos;
-        int end = start - node->delta;  // La plage de suppression est [start, end)
-        if (pos >= start && pos < end)
-            return 1;
-    }
-    
-    // Check in the left subtree
-    // If the position is less than the current node's position, check the left subtree
-    if (pos < node->pos)
-        return IsRemoved(node->left, NIL, pos);
-    
-    // Check in the right subtree
-    return IsRemoved(node->right, NIL, pos);
-}
-
-static void markRemovedPositions(Node *node, Node *NIL, bool *removed, int maxInput) 
+    int height = 0;
+    for (; node != NIL; node = node->left) 
+    {
+        if (node->color == BLACK)
+            height++;
+    }
+    return height;
+}
+
+static Node* lastNode(Node *node, Node *NIL) 
 {
     if (node == NIL)
-        return;
-    markRemovedPositions(node->left, NIL, removed, maxInput);
-    if (node->delta < 0) 
+        return NIL;
+    while (node->right != NIL) 
+    {
+        pushShift(node, NIL);
+        node = node->right;
+    }
+    return node;
+}
+
+static Node* joinTrees(MAGIC m, Node *left, int leftHeight, Node *mid, Node *right, int rightHeight, int *height) 
+{
+    Node *NIL = m->NIL;
+    mid->shift = 0;
+
+    // Same black height: the middle node becomes the root
+    if (leftHeight == rightHeight) 
     {
-        // Mark the range of removed positions
-        // The range should be [start, end)
-        int start = node->pos;
-        int end = start - node->delta;
-        if (end > maxInput + 1)
-            end = maxInput + 1;
+        mid->left = left;
+        mid->right = right;
+        mid->parent = NIL;
+        mid->color = BLACK;
+        if (left != NIL) left->parent = mid;
+        if (right != NIL) right->parent = mid;
+        updateTotalDelta(mid);
+        *height = leftHeight + 1;
+        return mid;
+    }
 
-        // Check if the range is valid
-        for (int i = start; i < end; i++) 
-        {
-            removed[i] = true;
-        }
+    // Walk down the spine of the taller tree to a black node
+    // as high as the other tree, and put the middle node in its place
+    bool onRight = leftHeight > rightHeight;
+    int current = onRight ? leftHeight : rightHeight;
+    int target = onRight ? rightHeight : leftHeight;
+    Node *parent = NIL, *node = onRight ? left : right;
+    m->root = node;
+    while (node->color == RED || current > target) 
+    {
+        if (node->color == BLACK)
+            current--;
+        pushShift(node, NIL);
+        parent = node;
+        node = onRight ? node->right : node->left;
+    }
+    mid->parent = parent;
+    mid->color = RED;
+    if (onRight) 
+    {
+        mid->left = node;
+        mid->right = right;
+        parent->right = mid;
+    } 
+    else 
+    {
+        mid->left = left;
+        mid->right = node;
+        parent->left = mid;
     }
+    if (mid->left != NIL) mid->left->parent = mid;
+    if (mid->right != NIL) mid->right->parent = mid;
+    updateTotalDelta(mid);
+    *height = (onRight ? leftHeight : rightHeight) + fixInsert(m, mid);
 
-    markRemovedPositions(node->right, NIL, removed, maxInput);
+    // Update totalDelta for all ancestors
+    for (Node *x = mid; x != NIL; x = x->parent)
+        updateTotalDelta(x);
+    return m->root;
 }
 
-static void updateCacheLocal(MAGIC m) 
+static void splitTree(MAGIC m, Node *node, int nodeHeight, int pos, Node **left, int *leftHeight, Node **right, int *rightHeight) 
 {
-    int maxInput = m->max_input_pos;
-    // Force the cache to be updated
-    m->cacheDirtyFrom = 0;
-    
-    // Check if the cache is valid
-    if (m->inMappingSize < maxInput + 1) 
+    Node *NIL = m->NIL;
+    if (node == NIL) 
     {
-        m->inMapping = realloc(m->inMapping, (maxInput + 1) * sizeof(int));
-        if (!m->inMapping) 
-        {
-            perror("Realloc inMapping");
-            exit(EXIT_FAILURE);
-        }
-        m->inMappingSize = maxInput + 1;
+        *left = *right = NIL;
+        *leftHeight = *rightHeight = 0;
+        return;
     }
+    pushShift(node, NIL);
 
-    // Check if the outMapping is valid
-    bool *removed = calloc(maxInput + 1, sizeof(bool));
-    if (!removed) {
-        perror("Allocation error in updateCacheLocal");
-        exit(EXIT_FAILURE);
+    // Detach both subtrees as standalone trees with a black root
+    int childHeight = nodeHeight - (node->color == BLACK);
+    Node *l = node->left, *r = node->right;
+    int lh = childHeight, rh = childHeight;
+    if (l != NIL) 
+    {
+        l->parent = NIL;
+        lh += l->color == RED;
+        l->color = BLACK;
+    }
+    if (r != NIL) 
+    {
+        r->parent = NIL;
+        rh += r->color == RED;
+        r->color = BLACK;
     }
-    markRemovedPositions(m->root, m->NIL, removed, maxInput);
 
-    // Loop through the removed positions and update the cache
-    for (int i = m->cacheDirtyFrom; i <= maxInput; i++) 
+    if (pos <= node->pos) 
     {
-        int cumulative = getCumulativeDelta(m->root, m->NIL, i);
-        int newMapping = removed[i] ? -1 : i + cumulative;
-        m->inMapping[i] = newMapping;
-        if (newMapping == -1)
-            continue;
-        if (newMapping >= m->outMappingSize) 
-        {
-            int newSize = newMapping + 1;
-            m->outMapping = realloc(m->outMapping, newSize * sizeof(int));
-            if (!m->outMapping) 
-            {
-                perror("Realloc outMapping");
-                exit(EXIT_FAILURE);
-            }
-            for (int j = m->outMappingSize; j < newSize; j++)
-                m->outMapping[j] = -1;
-            m->outMappingSize = newSize;
-        }
-        m->outMapping[newMapping] = i;
+        Node *middle;
+        int middleHeight;
+        splitTree(m, l, lh, pos, left, leftHeight, &middle, &middleHeight);
+        *right = joinTrees(m, middle, middleHeight, node, r, rh, rightHeight);
+    } 
+    else 
+    {
+        Node *middle;
+        int middleHeight;
+        splitTree(m, r, rh, pos, &middle, &middleHeight, right, rightHeight);
+        *left = joinTrees(m, l, lh, node, middle, middleHeight, leftHeight);
     }
-    free(removed);
-    m->cacheDirtyFrom = maxInput + 1;
-    m->cacheValid = 1;
 }
 
-//=============================================================================
-//============================== MAGIC API ====================================
-//=============================================================================
-
-MAGIC MAGICinit() 
+static Node* findNode(MAGIC m, int pos) 
 {
-    MAGIC m = malloc(sizeof(struct magic));
-    m->NIL = malloc(sizeof(Node));
-    m->NIL->color = BLACK;
-    m->NIL->totalDelta = 0;
-    m->NIL->left = m->NIL->right = m->NIL->parent = NULL;
-    m->root = m->NIL;
-    m->max_input_pos = 0;
-    m->outMapping = malloc(1 * sizeof(int));
-    m->outMapping[0] = -1;
-    m->outMappingSize = 1;
-    m->inMapping = malloc(1 * sizeof(int));
-    m->inMapping[0] = -1;
-    m->inMappingSize = 1;
-    m->cacheValid = 0;
-    m->cacheDirtyFrom = 0;
-    return m;
+    Node *node = m->root;
+    while (node != m->NIL && node->pos != pos) 
+    {
+        pushShift(node, m->NIL);
+        node = pos < node->pos ? node->left : node->right;
+    }
+    return node;
 }
 
-void MAGICadd(MAGIC m, int pos, int length) 
+static void insertAddition(MAGIC m, int pos, int length) 
 {
-    assert(m && length > 0);
+    // Merging into a removal would shorten it, so skip the removals starting here
+    Node *node = findNode(m, pos);
+    while (node != m->NIL && node->delta < 0) 
+    {
+        pos = node->pos - node->delta;
+        node = findNode(m, pos);
+    }
+    insertDelta(m, pos, length);
+}
 
-    // Get the current input position
-    int input_pos;
-    if (m->max_input_pos == 0 && m->root == m->NIL)
-        input_pos = -1;
-    else
-        input_pos = MAGICmap(m, STREAM_OUT_IN, pos);
-    
-    // Insert the delta into the red-black tree at the correct position
-    if (input_pos != -1) 
-    {
-        insertDelta(m, input_pos, length);
-        if (input_pos < m->cacheDirtyFrom)
-            m->cacheDirtyFrom = input_pos;
-    } 
-    else 
+static int cutRemovals(MAGIC m, int pos) 
+{
+    int cut = 0;
+    while (m->root->maxEnd > pos) 
     {
-        int max_out = m->max_input_pos + getCumulativeDelta(m->root, m->NIL, m->max_input_pos);
-        // Check if the position is greater than the maximum output position
-        // If so, we need to insert the delta at the input position
-        if (pos > max_out) 
-        {
-            input_pos = m->max_input_pos + (pos - max_out);
-            insertDelta(m, input_pos, length);
-            if (input_pos < m->cacheDirtyFrom)
-                m->cacheDirtyFrom = input_pos;
-        } 
-        else 
+        // Follow maxEnd down to a removal running past 'pos'
+        Node *node = m->root;
+        while (1) 
         {
-            // If the position is less than the maximum output position,
-            // we need to find the correct position to insert the delta
-            // in the red-black tree
-            for (int i = pos - 1; i >= 0; --i) 
-            {
-                int candidate = MAGICmap(m, STREAM_OUT_IN, i);
-                if (candidate != -1) 
-                {
-                    insertDelta(m, candidate + 1, length);
-                    if ((candidate + 1) < m->cacheDirtyFrom)
-                        m->cacheDirtyFrom = candidate + 1;
-                    invalidateCache(m);
-                }
-            }
-            insertDelta(m, 0, length);
-            m->cacheDirtyFrom = 0;
+            pushShift(node, m->NIL);
+            if (node->delta < 0 && node->pos - node->delta > pos)
+                break;
+            node = node->left->maxEnd > pos ? node->left : node->right;
         }
+        cut += node->pos - node->delta - pos;
+        node->delta = node->pos - pos;
+        for (; node != m->NIL; node = node->parent)
+            updateTotalDelta(node);
     }
+    return cut;
+}
 
-    // Update the cache
-    invalidateCache(m);
+static void resetTailFrom(MAGIC m) 
+{
+    Node *last = lastNode(m->root, m->NIL);
+    m->tailFrom = last != m->NIL ? last->pos : 0;
+    if (m->root->maxEnd > m->tailFrom)
+        m->tailFrom = m->root->maxEnd;
 }
 
+static void destroyTree(Node *node, Node *NIL) 
+{
+    if (node == NIL) return;
+    destroyTree(node->left, NIL);
+    destroyTree(node->right, NIL);
+    free(node);
+}
 
-void MAGICremove(MAGIC m, int pos, int length) 
+static int firstMapped(MAGIC m, int pos, int *outPos) 
 {
-    assert(m && length > 0);
+    int end;
+    int cumulative = getEditedDelta(m, pos, &end);
+    // Removals may overlap, so jump until no range covers the position
+    while (pos < end) 
+    {
+        pos = end;
+        cumulative = getEditedDelta(m, pos, &end);
+    }
+    *outPos = pos + cumulative;
+    return pos;
+}
 
-    // Always remove from the updated input stream
-    int input_pos = MAGICmap(m, STREAM_OUT_IN, pos);
-    if (input_pos == -1) 
+static int lowerBoundInput(MAGIC m, int pos, int *outPos) 
+{
+    // Past 'tailFrom', every input position is mapped to itself + totalDelta,
+    // so edits at the end of the stream are resolved without searching
+    int treeTotal = m->root->totalDelta;
+    int total = treeTotal + (m->logCount ? m->log[m->logCount - 1].cumulative : 0);
+    long long tail = (long long)pos - total;
+    if (tail >= m->tailFrom) 
     {
-        // Update the cache if it's not valid
-        if (!m->cacheValid) updateCacheLocal(m);
-        // If the cache is valid, we need to find the correct position
-        int low = pos, high = m->outMappingSize - 1;
-        int candidate_out = -1;
+        // Past the last input position, answer it with its output
+        if (tail > INT_MAX) 
+        {
+            *outPos = INT_MAX + total;
+            return INT_MAX;
+        }
+        *outPos = pos;
+        return (int)tail;
+    }
 
-        // Binary search to find the first position in the outMapping
-        // that is not -1 and is greater than the current position
-        while (low <= high) 
+    // Overlapping removals break the order findOutputSegment relies on:
+    // bisect on the output position of the first mapped input position instead
+    if (m->overlapping) 
+    {
+        int low = 0, high = m->tailFrom;
+        while (low < high) 
         {
-            int mid = (low + high) / 2;
-            if (m->outMapping[mid] != -1) 
-            {
-                candidate_out = mid;
-                high = mid - 1;
-            } 
-            else 
-            {
+            int mid = low + (high - low) / 2;
+            int mapped;
+            firstMapped(m, mid, &mapped);
+            if (mapped < pos)
                 low = mid + 1;
-            }
+            else
+                high = mid;
         }
-        if (candidate_out != -1 && pos < candidate_out)
-            input_pos = m->outMapping[candidate_out];
+        return firstMapped(m, low, outPos);
     }
-    // If the input position is still -1, we need to find the first
-    // position in the outMapping that is not -1 and is greater than the current position
-    if (input_pos != -1) 
+
+    // Find the segment of input positions [start, limit) with a constant cumulative
+    // delta whose outputs reach 'pos', in the log if they lie past every node
+    int cumulative, end, start, limit;
+    int treeEnd = m->root->maxEnd;
+    if (m->logCount && (long long)(m->log[0].pos > treeEnd ? m->log[0].pos : treeEnd) + treeTotal <= pos) 
     {
-        insertDelta(m, input_pos, -length);
-        if (input_pos < m->cacheDirtyFrom)
-            m->cacheDirtyFrom = input_pos;
+        // Same search as findOutputSegment over the logged edits
+        int low = 1, high = m->logCount;
+        while (low < high) 
+        {
+            int mid = low + (high - low) / 2;
+            int endBefore = m->log[mid - 1].maxEnd > treeEnd ? m->log[mid - 1].maxEnd : treeEnd;
+            int first = m->log[mid].pos > endBefore ? m->log[mid].pos : endBefore;
+            if ((long long)first + treeTotal + m->log[mid - 1].cumulative > pos)
+                high = mid;
+            else
+                low = mid + 1;
+        }
+        const LoggedEdit *edit = &m->log[low - 1];
+        cumulative = treeTotal + edit->cumulative;
+        end = edit->maxEnd > treeEnd ? edit->maxEnd : treeEnd;
+        start = edit->pos;
+        limit = low < m->logCount ? m->log[low].pos : INT_MAX;
     }
-    // Otherwise, we need to find the first position in the outMapping
-    // that is not -1 and is greater than the current position 
     else 
     {
-        for (int i = pos + 1; i <= m->max_input_pos; ++i) 
-        {
-            int candidate = MAGICmap(m, STREAM_OUT_IN, i);
-            if (candidate != -1) 
-            {
-                insertDelta(m, candidate, -length);
-                if (candidate < m->cacheDirtyFrom)
-                    m->cacheDirtyFrom = candidate;
-                break;
-            }
-        }
+        Node *last, *next;
+        cumulative = findOutputSegment(m->root, m->NIL, pos, &end, &last, &next);
+        start = last != m->NIL ? last->pos : 0;
+        limit = next != m->NIL ? next->pos : m->logCount ? m->log[0].pos : INT_MAX;
     }
-    invalidateCache(m);
+
+    // First input position of the segment that is not removed and reaches 'pos'
+    long long input = (long long)pos - cumulative;
+    if (input < start)
+        input = start;
+    if (input < end)
+        input = end;
+    // Removals running past the segment overlap the next edits: skip them one by one
+    if (input >= limit)
+        return firstMapped(m, (int)input, outPos);
+    *outPos = (int)input + cumulative;
+    return (int)input;
 }
 
+static int mapInOut(MAGIC m, int pos) 
+{
+    int end;
+    Node *next;
+    int cumulative = getCumulativeDelta(m->root, m->NIL, pos, &end, &next);
+    // Outputs past INT_MAX cannot be returned
+    long long mapped = (long long)pos + cumulative;
+    return pos < end || mapped > INT_MAX ? -1 : (int)mapped;
+}
 
-int MAGICmap(MAGIC m, enum MAGICDirection direction, int pos) 
+static int mapOutIn(MAGIC m, int pos) 
 {
-    assert(m && pos >= 0);
+    int mapped;
+    int input_pos = lowerBoundInput(m, pos, &mapped);
+    return mapped == pos ? input_pos : -1;
+}
+
+static Page** pageBucket(MAGIC m, int direction, int index) 
+{
+    unsigned int hash = ((unsigned int)index * 2u + (unsigned int)direction) * 2654435761u;
+    return &m->buckets[hash & (unsigned int)(m->bucketCount - 1)];
+}
+
+static void dropPage(MAGIC m, Page *page) 
+{
+    // Unlink from the hash bucket
+    Page **link = pageBucket(m, page->direction, page->index);
+    while (*link != page)
+        link = &(*link)->next;
+    *link = page->next;
+
+    // Unlink from the LRU list
+    if (page->newer) page->newer->older = page->older;
+    else m->newest = page->older;
+    if (page->older) page->older->newer = page->newer;
+    else m->oldest = page->newer;
 
-    // direction == STREAM_IN_OUT
-    if (direction == STREAM_IN_OUT) 
+    m->cacheUsed -= sizeof(Page);
+    free(page);
+}
+
+static void fillInPage(MAGIC m, Page *page) 
+{
+    int first = page->index * CACHE_PAGE_SIZE;
+    int end;
+    Node *next;
+    int cumulative = getCumulativeDelta(m->root, m->NIL, first, &end, &next);
+    for (int i = 0; i < CACHE_PAGE_SIZE; i++) 
     {
-        // Update the cache if it's not valid
-        if (!m->cacheValid) updateCacheLocal(m);
-        
-        // Work with the input mapping cache
-        if (pos < m->inMappingSize) return m->inMapping[pos];
-        else 
+        // Walk the nodes in order instead of descending for every position
+        while (next != m->NIL && next->pos <= first + i) 
         {
-            if (IsRemoved(m->root, m->NIL, pos))
-                return -1;
-            return pos + getCumulativeDelta(m->root, m->NIL, pos);
+            cumulative += next->delta;
+            if (next->delta < 0 && next->pos - next->delta > end)
+                end = next->pos - next->delta;
+            next = successor(next, m->NIL);
         }
-    } 
-    // direction == STREAM_OUT_IN
-    else 
-    { 
-        if (!m->cacheValid) updateCacheLocal(m);
+        long long mapped = (long long)first + i + cumulative;
+        page->map[i] = first + i < end || mapped > INT_MAX ? -1 : (int)mapped;
+    }
+}
 
-        // Work with the output mapping cache
-        if (pos < m->outMappingSize) return m->outMapping[pos];
-        else 
+static void fillOutPage(MAGIC m, Page *page) 
+{
+    int first = page->index * CACHE_PAGE_SIZE;
+    for (int i = 0; i < CACHE_PAGE_SIZE; i++)
+        page->map[i] = -1;
+
+    // Walk the mapped input positions whose output lands in the page
+    int mapped;
+    int input_pos = lowerBoundInput(m, first, &mapped);
+    int end;
+    Node *next;
+    int cumulative = getCumulativeDelta(m->root, m->NIL, input_pos, &end, &next);
+    while (1) 
+    {
+        while (next != m->NIL && next->pos <= input_pos) 
         {
-            int low = 0, high = pos + 100;
-            int candidate = -1;
-            // Binary search to find the first position in the outMapping
-            while (low <= high) 
-            {
-                int mid = (low + high) / 2;
-                int mapped = mid + getCumulativeDelta(m->root, m->NIL, mid);
-                if (mapped == pos) 
-                {
-                    candidate = mid;
-                    break;
-                } 
-                else if (mapped < pos) 
-                {
-                    low = mid + 1;
-                } 
-                else 
-                {
-                    high = mid - 1;
-                }
-            }
-            if (candidate != -1 && !IsRemoved(m->root, m->NIL, candidate))
-                return candidate;
-            else
-                return -1;
+            cumulative += next->delta;
+            if (next->delta < 0 && next->pos - next->delta > end)
+                end = next->pos - next->delta;
+            next = successor(next, m->NIL);
+        }
+        if (input_pos < end) 
+        {
+            input_pos = end;
+            continue;
         }
+        long long output = (long long)input_pos + cumulative;
+        if (output - first >= CACHE_PAGE_SIZE)
+            break;
+        if (output >= first)
+            page->map[output - first] = input_pos;
+        // The last page may end before the output of the last input position
+        if (input_pos == INT_MAX)
+            break;
+        input_pos++;
     }
 }
 
-void MAGICdestroy(MAGIC m) 
+static Page* findPage(MAGIC m, int direction, int index) 
 {
-    destroyTree(m->root, m->NIL);
-    free(m->NIL);
-    free(m->outMapping);
-    free(m->inMapping);
-    free(m);
-}
\ No newline at end of file
+    if (!m->buckets)
+        return NULL;
+
+    Page *page = *pageBucket(m, direction, index);
+    while (page && (page->direction != direction || page->index != index))
+        page = page->next;
+
+    // Hit: move the page to the front of the LRU list
+    if (page && page != m->newest) 
+    {
+        page->newer->older = page->older;
+        if (page->older) page->older->newer = page->newer;
+        else m->oldest = page->newer;
+        page->newer = NULL;
+        page->older = m->newest;
+        m->newest->newer = page;
+        m->newest = page;
+    }
+    return page;
+}
+
+static Page* getPage(MAGIC m, int direction, int index) 
+{
+    if (m->cacheBudget < sizeof(Page))
+        return NULL;
+
+    // Create the hash table on first use
+    if (!m->buckets) 
+    {
+        size_t maxPages = m->cacheBudget / sizeof(Page);
+        int count = CACHE_MIN_BUCKETS;
+        while ((size_t)count < maxPages && count < CACHE_MAX_BUCKETS)
+            count *= 2;
+        m->buckets = calloc(count, sizeof(Page *));
+        if (!m->buckets)
+            return NULL;
+        m->bucketCount = count;
+    }
+
+    Page *page = findPage(m, direction, index);
+    if (page)
+        return page;
+
+    // Miss: evict the least recently used pages until the new one fits
+    while (m->oldest && m->cacheUsed + sizeof(Page) > m->cacheBudget) 
+    {
+        dropPage(m, m->oldest);
+        m->stats.pageEvictions++;
+    }
+    page = malloc(sizeof(Page));
+    if (!page)
+        return NULL;
+    page->direction = direction;
+    page->index = index;
+    if (direction == STREAM_IN_OUT)
+        fillInPage(m, page);
+    else
+        fillOutPage(m, page);
+    m->stats.pageFills++;
+
+    Page **bucket = pageBucket(m, direction, index);
+    page->next = *bucket;
+    *bucket = page;
+    page->newer = NULL;
+    page->older = m->newest;
+    if (m->newest) m->newest->newer = page;
+    else m->oldest = page;
+    m->newest = page;
+    m->cacheUsed += sizeof(Page);
+    return page;
+}
+
+static void invalidatePages(MAGIC m, int pos) 
+{
+    if (!m->newest)
+        return;
+
+    // Outputs before the edited input keep their preimage
+    int outFrom = 0;
+    if (pos > 0) 
+    {
+        int end;
+        Node *next;
+        outFrom = pos + getCumulativeDelta(m->root, m->NIL, pos - 1, &end, &next);
+    }
+
+    Page *page = m->newest;
+    while (page) 
+    {
+        Page *older = page->older;
+        int from = page->direction == STREAM_IN_OUT ? pos : outFrom;
+        // Compare page indexes, as the end of the last page does not fit in an int
+        if (page->index >= from / CACHE_PAGE_SIZE) 
+        {
+            dropPage(m, page);
+            m->stats.pageInvalidations++;
+        }
+        page = older;
+    }
+}
+
+static void thaw(MAGIC m) 
+{
+    destroyFrozen(m->frozen);
+    m->frozen = NULL;
+}
+
+static void updateTailFrom(MAGIC m, int pos, int delta) 
+{
+    // A removal covers [pos, pos - delta)
+    int end = delta < 0 ? pos - delta : pos;
+    if (end > m->tailFrom)
+        m->tailFrom = end;
+}
+
+static int getEditedDelta(MAGIC m, int pos, int *removedEnd) 
+{
+    int end;
+    Node *next;
+    int sum = getCumulativeDelta(m->root, m->NIL, pos, &end, &next);
+
+    // Binary search for the last logged edit at or before 'pos'
+    int low = 0, high = m->logCount && m->log[0].pos <= pos ? m->logCount : 0;
+    while (low < high) 
+    {
+        int mid = low + (high - low) / 2;
+        if (m->log[mid].pos <= pos)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low > 0) 
+    {
+        sum += m->log[low - 1].cumulative;
+        if (m->log[low - 1].maxEnd > end)
+            end = m->log[low - 1].maxEnd;
+    }
+    *removedEnd = end;
+    return sum;
+}
+
+static void logEdit(MAGIC m, int pos, int delta) 
+{
+    // The pages are checked once on the next query
+    if (pos < m->staleFrom)
+        m->staleFrom = pos;
+
+    // Only edits past every node are logged, so that the log is merged by joining
+    // a tree built from it; the others cost one insertion, as early as later
+    if (pos <= m->tailFrom) 
+    {
+        Node *last = lastNode(m->root, m->NIL);
+        if (last != m->NIL && pos <= last->pos) 
+        {
+            insertDelta(m, pos, delta);
+            return;
+        }
+    }
+
+    // Edits past every logged one, the common case, go at the end
+    int i = m->logCount;
+    if (i > 0 && m->log[i - 1].pos >= pos) 
+    {
+        // Binary search for the first logged edit at or after 'pos'
+        int low = 0, high = i - 1;
+        while (low < high) 
+        {
+            int mid = low + (high - low) / 2;
+            if (m->log[mid].pos < pos)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        i = low;
+    }
+
+    if (i < m->logCount && m->log[i].pos == pos) 
+    {
+        // Edits on the same position are merged like in insertDelta
+        m->log[i].delta += delta;
+    }
+    else 
+    {
+        if (m->logCount == EDIT_LOG_CAPACITY) 
+        {
+            // Input positions do not move when the log is merged, but an edit
+            // before a logged one now lies before a node
+            bool pastLog = i == m->logCount;
+            flushLog(m);
+            m->staleFrom = pos;
+            if (!pastLog) 
+            {
+                insertDelta(m, pos, delta);
+                return;
+            }
+            i = 0;
+        }
+        if (m->logCount == m->logCapacity) 
+        {
+            int newCapacity = m->logCapacity ? 2 * m->logCapacity : 64;
+            LoggedEdit *newLog = realloc(m->log, newCapacity * sizeof(LoggedEdit));
+            // Out of memory: insert directly into the tree
+            if (!newLog) 
+            {
+                flushLog(m);
+                m->staleFrom = pos;
+                insertDelta(m, pos, delta);
+                return;
+            }
+            m->log = newLog;
+            m->logCapacity = newCapacity;
+        }
+        memmove(&m->log[i + 1], &m->log[i], (m->logCount - i) * sizeof(LoggedEdit));
+        m->logCount++;
+        m->log[i].pos = pos;
+        m->log[i].delta = delta;
+    }
+    updateTailFrom(m, pos, m->log[i].delta);
+
+    // Update the running sums from the edited entry
+    for (; i < m->logCount; i++) 
+    {
+        LoggedEdit *edit = &m->log[i];
+        int end = edit->delta < 0 ? edit->pos - edit->delta : 0;
+        edit->cumulative = edit->delta;
+        edit->maxEnd = end;
+        if (i > 0) 
+        {
+            edit->cumulative += m->log[i - 1].cumulative;
+            if (m->log[i - 1].maxEnd > edit->maxEnd)
+                edit->maxEnd = m->log[i - 1].maxEnd;
+        }
+    }
+}
+
+static void checkOverlap(MAGIC m, int pos) 
+{
+    // Nothing starts after the last logged edit
+    if (m->logCount && m->log[m->logCount - 1].pos == pos)
+        return;
+    int end;
+    getEditedDelta(m, pos, &end);
+    // Nothing else starts inside a removal of a single position
+    if (end <= pos + 1)
+        return;
+
+    int unused;
+    Node *next;
+    getCumulativeDelta(m->root, m->NIL, pos, &unused, &next);
+    for (; next != m->NIL && next->pos < end; next = successor(next, m->NIL)) 
+    {
+        if (next->delta < 0)
+            m->overlapping = true;
+    }
+
+    // Binary search for the first logged edit after 'pos'
+    int low = 0, high = m->logCount;
+    while (low < high) 
+    {
+        int mid = low + (high - low) / 2;
+        if (m->log[mid].pos <= pos)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    for (; low < m->logCount && m->log[low].pos < end; low++) 
+    {
+        if (m->log[low].delta < 0)
+            m->overlapping = true;
+    }
+}
+
+static Node* buildTree(Node **nodes, int count, int depth, int redDepth, Node *parent, Node *NIL) 
+{
+    if (count == 0)
+        return NIL;
+    int mid = count / 2;
+    Node *node = nodes[mid];
+    node->parent = parent;
+    node->shift = 0;
+    node->color = depth == redDepth ? RED : BLACK;
+    node->left = buildTree(nodes, mid, depth + 1, redDepth, node, NIL);
+    node->right = buildTree(nodes + mid + 1, count - mid - 1, depth + 1, redDepth, node, NIL);
+    updateTotalDelta(node);
+    return node;
+}
+
+static Node* buildBalanced(MAGIC m, Node **nodes, int count, int *height) 
+{
+    // Leaves are at most one level apart: only the deepest level is red
+    int depth = 0;
+    while ((2 << depth) <= count)
+        depth++;
+    *height = count == 0 ? 0 : depth == 0 ? 1 : depth;
+    return buildTree(nodes, count, 0, depth > 0 ? depth : -1, m->NIL, m->NIL);
+}
+
+static void flushLog(MAGIC m) 
+{
+    // Pages are dropped once for a whole burst of edits; outputs before the first
+    // edited position are the same with or without the log
+    if (m->logCount && m->log[0].pos < m->staleFrom)
+        m->staleFrom = m->log[0].pos;
+    if (m->staleFrom != INT_MAX) 
+    {
+        invalidatePages(m, m->staleFrom);
+        m->staleFrom = INT_MAX;
+    }
+    if (m->logCount == 0)
+        return;
+    m->stats.logFlushes++;
+
+    // Every logged edit lies past the last node: build a tree of the log and join it on the right
+    int height = blackHeight(m->root, m->NIL);
+    Node **nodes = malloc(m->logCount * sizeof(Node *));
+    int count = 0;
+    if (nodes) 
+    {
+        for (int i = 0; i < m->logCount; i++) 
+        {
+            if (m->log[i].delta == 0)
+                continue;
+            nodes[count] = createNode(m, m->log[i].pos, m->log[i].delta);
+            if (!nodes[count])
+                break;
+            count++;
+        }
+        if (count > 0) 
+        {
+            int restHeight;
+            Node *rest = buildBalanced(m, nodes + 1, count - 1, &restHeight);
+            m->root = joinTrees(m, m->root, height, nodes[0], rest, restHeight, &height);
+        }
+        free(nodes);
+    }
+    // Out of memory: insert what is left one by one
+    for (int i = 0, created = 0; i < m->logCount; i++) 
+    {
+        if (m->log[i].delta != 0 && created++ >= count)
+            insertDelta(m, m->log[i].pos, m->log[i].delta);
+    }
+    m->logCount = 0;
+}
+
+static inline int frozenRankScalar(const int *keys, int pos) 
+{
+    // Counting instead of searching keeps the loop free of branches
+    int rank = 0;
+    for (int j = 0; j < FROZEN_BLOCK; j++)
+        rank += keys[j] <= pos;
+    return rank;
+}
+
+static int frozenSearchScalar(const FrozenTree *tree, int pos) 
+{
+    int block = 0, found = tree->blocks * FROZEN_BLOCK;
+    while (block < tree->blocks) 
+    {
+        int i = frozenRankScalar(tree->keys + block * FROZEN_BLOCK, pos);
+        found = i < FROZEN_BLOCK ? block * FROZEN_BLOCK + i : found;
+        block = block * (FROZEN_BLOCK + 1) + i + 1;
+    }
+    return found;
+}
+
+static void frozenSearchBatchScalar(const FrozenTree *tree, const int *pos, int *slots, int count) 
+{
+    int block[BATCH_GROUP];
+    for (int j = 0; j < count; j++) 
+    {
+        block[j] = 0;
+        slots[j] = tree->blocks * FROZEN_BLOCK;
+    }
+    // One level of every search per round, paths differ in length by at most one level
+    for (int active = count; active > 0; ) 
+    {
+        active = 0;
+        for (int j = 0; j < count; j++) 
+        {
+            if (block[j] >= tree->blocks)
+                continue;
+            int i = frozenRankScalar(tree->keys + block[j] * FROZEN_BLOCK, pos[j]);
+            slots[j] = i < FROZEN_BLOCK ? block[j] * FROZEN_BLOCK + i : slots[j];
+            block[j] = block[j] * (FROZEN_BLOCK + 1) + i + 1;
+            if (block[j] < tree->blocks) 
+            {
+                __builtin_prefetch(tree->keys + block[j] * FROZEN_BLOCK);
+                active++;
+            }
+        }
+    }
+}
+
+#ifdef FROZEN_AVX2
+__attribute__((target("avx2"))) 
+static inline int frozenRankAvx2(const int *keys, __m256i pos) 
+{
+    // Keys are sorted in a block, so the first key > 'pos' is the lowest mask bit
+    __m256i low = _mm256_cmpgt_epi32(_mm256_load_si256((const __m256i *)keys), pos);
+    __m256i high = _mm256_cmpgt_epi32(_mm256_load_si256((const __m256i *)keys + 1), pos);
+    unsigned int mask = (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(low))
+                      | (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(high)) << 8;
+    return __builtin_ctz(mask | 1u << FROZEN_BLOCK);
+}
+
+__attribute__((target("avx2"))) 
+static int frozenSearchAvx2(const FrozenTree *tree, int pos) 
+{
+    __m256i key = _mm256_set1_epi32(pos);
+    int block = 0, found = tree->blocks * FROZEN_BLOCK;
+    while (block < tree->blocks) 
+    {
+        int i = frozenRankAvx2(tree->keys + block * FROZEN_BLOCK, key);
+        found = i < FROZEN_BLOCK ? block * FROZEN_BLOCK + i : found;
+        block = block * (FROZEN_BLOCK + 1) + i + 1;
+    }
+    return found;
+}
+
+__attribute__((target("avx2"))) 
+static void frozenSearchBatchAvx2(const FrozenTree *tree, const int *pos, int *slots, int count) 
+{
+    int block[BATCH_GROUP];
+    for (int j = 0; j < count; j++) 
+    {
+        block[j] = 0;
+        slots[j] = tree->blocks * FROZEN_BLOCK;
+    }
+    // One level of every search per round, paths differ in length by at most one level
+    for (int active = count; active > 0; ) 
+    {
+        active = 0;
+        for (int j = 0; j < count; j++) 
+        {
+            if (block[j] >= tree->blocks)
+                continue;
+            int i = frozenRankAvx2(tree->keys + block[j] * FROZEN_BLOCK, _mm256_set1_epi32(pos[j]));
+            slots[j] = i < FROZEN_BLOCK ? block[j] * FROZEN_BLOCK + i : slots[j];
+            block[j] = block[j] * (FROZEN_BLOCK + 1) + i + 1;
+            if (block[j] < tree->blocks) 
+            {
+                __builtin_prefetch(tree->keys + block[j] * FROZEN_BLOCK);
+                active++;
+            }
+        }
+    }
+}
+#endif
+
+static inline int frozenMap(FrozenSegment segment, int direction, int pos) 
+{
+    if (direction == STREAM_IN_OUT)
+        return pos < segment.bound || (long long)pos + segment.shift > INT_MAX ? -1 : pos + segment.shift;
+    return pos < segment.bound ? pos + segment.shift : -1;
+}
+
+static void getCumulativeDeltas(MAGIC m, const int *pos, int count, int *cumulative, int *removedEnd) 
+{
+    Node *NIL = m->NIL;
+    Node *node[BATCH_GROUP];
+    for (int j = 0; j < count; j++) 
+    {
+        node[j] = m->root;
+        cumulative[j] = 0;
+        removedEnd[j] = 0;
+    }
+
+    // Every descent is at the same depth, so pushing a shift never
+    // moves a node that another descent is reading
+    for (int active = count; active > 0; ) 
+    {
+        // Request the children of every current node before reading any of them
+        for (int j = 0; j < count; j++) 
+        {
+            __builtin_prefetch(node[j]->left);
+            __builtin_prefetch(node[j]->right);
+        }
+        active = 0;
+        for (int j = 0; j < count; j++) 
+        {
+            Node *x = node[j];
+            if (x == NIL)
+                continue;
+            pushShift(x, NIL);
+            if (pos[j] < x->pos) 
+            {
+                node[j] = x->left;
+            }
+            else 
+            {
+                cumulative[j] += x->delta + x->left->totalDelta;
+                if (x->left->maxEnd > removedEnd[j])
+                    removedEnd[j] = x->left->maxEnd;
+                if (x->delta < 0 && x->pos - x->delta > removedEnd[j])
+                    removedEnd[j] = x->pos - x->delta;
+                node[j] = x->right;
+            }
+            active += node[j] != NIL;
+        }
+    }
+}
+
+static void findOutputSegments(MAGIC m, const int *pos, int count, int *cumulative, int *removedEnd, Node **lastNode, Node **nextNode) 
+{
+    Node *NIL = m->NIL;
+    Node *node[BATCH_GROUP];
+    for (int j = 0; j < count; j++) 
+    {
+        node[j] = m->root;
+        cumulative[j] = 0;
+        removedEnd[j] = 0;
+        lastNode[j] = nextNode[j] = NIL;
+    }
+
+    for (int active = count; active > 0; ) 
+    {
+        for (int j = 0; j < count; j++) 
+        {
+            __builtin_prefetch(node[j]->left);
+            __builtin_prefetch(node[j]->right);
+        }
+        active = 0;
+        for (int j = 0; j < count; j++) 
+        {
+            Node *x = node[j];
+            if (x == NIL)
+                continue;
+            pushShift(x, NIL);
+            // Same key as findOutputSegment
+            int before = cumulative[j] + x->left->totalDelta;
+            int endBefore = x->left->maxEnd > removedEnd[j] ? x->left->maxEnd : removedEnd[j];
+            int first = x->pos > endBefore ? x->pos : endBefore;
+            if ((long long)first + before > pos[j]) 
+            {
+                nextNode[j] = x;
+                node[j] = x->left;
+            }
+            else 
+            {
+                cumulative[j] = before + x->delta;
+                removedEnd[j] = endBefore;
+                if (x->delta < 0 && x->pos - x->delta > removedEnd[j])
+                    removedEnd[j] = x->pos - x->delta;
+                lastNode[j] = x;
+                node[j] = x->right;
+            }
+            active += node[j] != NIL;
+        }
+    }
+}
+
+static void mapInOutBatch(MAGIC m, const int *pos, int *result, int count) 
+{
+    int cumulative[BATCH_GROUP], end[BATCH_GROUP];
+    getCumulativeDeltas(m, pos, count, cumulative, end);
+    for (int j = 0; j < count; j++) 
+    {
+        long long mapped = (long long)pos[j] + cumulative[j];
+        result[j] = pos[j] < end[j] || mapped > INT_MAX ? -1 : (int)mapped;
+    }
+}
+
+static void mapOutInBatch(MAGIC m, const int *pos, int *result, int count) 
+{
+    if (m->overlapping) 
+    {
+        bisectOutInBatch(m, pos, result, count);
+        return;
+    }
+
+    // Past 'tailFrom', answer without searching like lowerBoundInput
+    int index[BATCH_GROUP], probes[BATCH_GROUP];
+    int active = 0;
+    for (int j = 0; j < count; j++) 
+    {
+        long long tail = (long long)pos[j] - m->root->totalDelta;
+        if (tail >= m->tailFrom) 
+        {
+            result[j] = tail > INT_MAX ? -1 : (int)tail;
+            continue;
+        }
+        index[active] = j;
+        probes[active++] = pos[j];
+    }
+    if (active == 0)
+        return;
+
+    int cumulative[BATCH_GROUP], end[BATCH_GROUP];
+    Node *last[BATCH_GROUP], *next[BATCH_GROUP];
+    findOutputSegments(m, probes, active, cumulative, end, last, next);
+    for (int k = 0; k < active; k++) 
+    {
+        int j = index[k];
+        // First input position of the segment that is not removed, as in lowerBoundInput
+        long long input = (long long)pos[j] - cumulative[k];
+        int start = last[k] != m->NIL ? last[k]->pos : 0;
+        int limit = next[k] != m->NIL ? next[k]->pos : INT_MAX;
+        if (input < start)
+            input = start;
+        if (input < end[k])
+            input = end[k];
+        int mapped;
+        if (input >= limit)
+            input = firstMapped(m, (int)input, &mapped);
+        else
+            mapped = (int)input + cumulative[k];
+        result[j] = mapped == pos[j] ? (int)input : -1;
+    }
+}
+
+static void bisectOutInBatch(MAGIC m, const int *pos, int *result, int count) 
+{
+    // Every query runs the binary search of lowerBoundInput, one descent per round
+    int low[BATCH_GROUP], high[BATCH_GROUP], probe[BATCH_GROUP];
+    bool last[BATCH_GROUP];
+    for (int j = 0; j < count; j++) 
+    {
+        // Past 'tailFrom', answer without searching like lowerBoundInput
+        long long tail = (long long)pos[j] - m->root->totalDelta;
+        if (tail >= m->tailFrom) 
+        {
+            result[j] = tail > INT_MAX ? -1 : (int)tail;
+            probe[j] = -1;
+            continue;
+        }
+        low[j] = 0;
+        high[j] = m->tailFrom;
+        last[j] = low[j] >= high[j];
+        probe[j] = last[j] ? low[j] : low[j] + (high[j] - low[j]) / 2;
+    }
+
+    int index[BATCH_GROUP], probes[BATCH_GROUP];
+    int cumulative[BATCH_GROUP], end[BATCH_GROUP];
+    while (1) 
+    {
+        // Gather the queries still searching (probe is -1 once answered)
+        int active = 0;
+        for (int j = 0; j < count; j++) 
+        {
+            if (probe[j] >= 0) 
+            {
+                index[active] = j;
+                probes[active++] = probe[j];
+            }
+        }
+        if (active == 0)
+            break;
+        getCumulativeDeltas(m, probes, active, cumulative, end);
+
+        for (int k = 0; k < active; k++) 
+        {
+            int j = index[k];
+            // Removed: probe again from the end of the removal like firstMapped
+            if (probe[j] < end[k]) 
+            {
+                probe[j] = end[k];
+                continue;
+            }
+            int mapped = probe[j] + cumulative[k];
+            if (last[j]) 
+            {
+                result[j] = mapped == pos[j] ? probe[j] : -1;
+                probe[j] = -1;
+                continue;
+            }
+            if (mapped < pos[j])
+                low[j] = low[j] + (high[j] - low[j]) / 2 + 1;
+            else
+                high[j] = low[j] + (high[j] - low[j]) / 2;
+            last[j] = low[j] >= high[j];
+            probe[j] = last[j] ? low[j] : low[j] + (high[j] - low[j]) / 2;
+        }
+    }
+}
+
+static void fillFrozenBlocks(FrozenTree *tree, const int *sorted, const FrozenSegment *segments, int count, int block, int *next) 
+{
+    if (block >= tree->blocks)
+        return;
+    for (int i = 0; i < FROZEN_BLOCK; i++) 
+    {
+        fillFrozenBlocks(tree, sorted, segments, count, block * (FROZEN_BLOCK + 1) + i + 1, next);
+        // Segments are stored by slot, so a search ends with a single load
+        int slot = block * FROZEN_BLOCK + i;
+        tree->segments[slot] = segments[*next];
+        tree->keys[slot] = *next < count ? sorted[(*next)++] : INT_MAX;
+    }
+    fillFrozenBlocks(tree, sorted, segments, count, block * (FROZEN_BLOCK + 1) + FROZEN_BLOCK + 1, next);
+}
+
+static int buildFrozenTree(FrozenTree *tree, const int *sorted, const FrozenSegment *segments, int count) 
+{
+    tree->blocks = (count + FROZEN_BLOCK - 1) / FROZEN_BLOCK;
+    size_t slots = (size_t)tree->blocks * FROZEN_BLOCK;
+    tree->memory = malloc(slots * sizeof(int) + 64);
+    tree->segments = malloc((slots + 1) * sizeof(FrozenSegment));
+    if (!tree->memory || !tree->segments)
+        return 0;
+    tree->keys = (int *)(((uintptr_t)tree->memory + 63) & ~(uintptr_t)63);
+    tree->segments[slots] = segments[count];
+    int next = 0;
+    fillFrozenBlocks(tree, sorted, segments, count, 0, &next);
+    return 1;
+}
+
+static void destroyFrozen(Frozen *frozen) 
+{
+    if (!frozen)
+        return;
+    for (int direction = 0; direction < 2; direction++) 
+    {
+        free(frozen->trees[direction].memory);
+        free(frozen->trees[direction].segments);
+    }
+    free(frozen);
+}
+
+//=============================================================================
+//============================== MAGIC API ====================================
+//=============================================================================
+
+MAGIC MAGICinit() 
+{
+    MAGICOptions options = { MAGIC_DEFAULT_CACHE_BUDGET };
+    return MAGICinitWithOptions(&options);
+}
+
+MAGIC MAGICinitWithOptions(const MAGICOptions *options) 
+{
+    assert(options);
+
+    MAGIC m = malloc(sizeof(struct magic));
+    m->NIL = &nilNode;
+    m->root = m->NIL;
+    m->buckets = NULL;
+    m->bucketCount = 0;
+    m->newest = m->oldest = NULL;
+    m->cacheUsed = 0;
+    m->cacheBudget = options->cacheBudget;
+    m->tailFrom = 0;
+    m->log = NULL;
+    m->logCount = 0;
+    m->logCapacity = 0;
+    m->staleFrom = INT_MAX;
+    m->overlapping = false;
+    m->stats = (MAGICStats){ 0 };
+    m->frozen = NULL;
+    return m;
+}
+
+void MAGICadd(MAGIC m, int pos, int length) 
+{
+    assert(m && length > 0);
+
+    thaw(m);
+    // The new bytes go before the first input byte still shown at or after 'pos'
+    int mapped;
+    int input_pos = lowerBoundInput(m, pos, &mapped);
+    // Logged until the next query without touching the tree
+    logEdit(m, input_pos, length);
+}
+
+
+void MAGICremove(MAGIC m, int pos, int length) 
+{
+    assert(m && length > 0);
+
+    thaw(m);
+    // Always remove from the first input byte still shown at or after 'pos'
+    int mapped;
+    int input_pos = lowerBoundInput(m, pos, &mapped);
+    // Removal ends must fit in an int: nothing past INT_MAX can be removed
+    if (length > INT_MAX - input_pos)
+        length = INT_MAX - input_pos;
+    if (length == 0)
+        return;
+    logEdit(m, input_pos, -length);
+    // Positions already removed are counted again when a removal covers another one
+    if (!m->overlapping)
+        checkOverlap(m, input_pos);
+}
+
+
+int MAGICmap(MAGIC m, enum MAGICDirection direction, int pos) 
+{
+    assert(m && pos >= 0);
+
+    // Frozen mapping: positions of cached pages are cheaper to read from the
+    // page, the others take one search over the flat tree of this direction
+    Frozen *frozen = m->frozen;
+    if (frozen && (direction == STREAM_IN_OUT || frozen->outIn)) 
+    {
+        Page *page = findPage(m, direction, pos / CACHE_PAGE_SIZE);
+        if (page)
+            return page->map[pos % CACHE_PAGE_SIZE];
+        const FrozenTree *tree = &frozen->trees[direction];
+        return frozenMap(tree->segments[frozen->search(tree, pos)], direction, pos);
+    }
+
+    // Logged edits must be in the tree before answering
+    flushLog(m);
+
+    // Hot regions are answered from the cache
+    Page *page = getPage(m, direction, pos / CACHE_PAGE_SIZE);
+    if (page)
+        return page->map[pos % CACHE_PAGE_SIZE];
+    // Cache disabled or out of memory: walk the tree
+    if (direction == STREAM_IN_OUT)
+        return mapInOut(m, pos);
+    return mapOutIn(m, pos);
+}
+
+void MAGICmapBatch(MAGIC m, enum MAGICDirection direction, const int *in, int *out, int count) 
+{
+    assert(m && count >= 0 && (count == 0 || (in && out)));
+
+    // Logged edits must be in the tree before answering
+    Frozen *frozen = m->frozen;
+    bool isFrozen = frozen && (direction == STREAM_IN_OUT || frozen->outIn);
+    if (!isFrozen)
+        flushLog(m);
+
+    // Dense batches reuse every page many times: fill them like MAGICmap when they all fit
+    if (!isFrozen && count > 0) 
+    {
+        int low = in[0], high = in[0];
+        for (int i = 1; i < count; i++) 
+        {
+            if (in[i] < low) low = in[i];
+            if (in[i] > high) high = in[i];
+        }
+        size_t pages = (size_t)(high / CACHE_PAGE_SIZE - low / CACHE_PAGE_SIZE) + 1;
+        if ((size_t)count >= BATCH_DENSE * pages && pages <= m->cacheBudget / sizeof(Page)) 
+        {
+            for (int i = 0; i < count; i++)
+                out[i] = MAGICmap(m, direction, in[i]);
+            return;
+        }
+    }
+
+    for (int first = 0; first < count; first += BATCH_GROUP) 
+    {
+        // Copy the group so that 'in' and 'out' may be the same array
+        int size = count - first < BATCH_GROUP ? count - first : BATCH_GROUP;
+        int pos[BATCH_GROUP], index[BATCH_GROUP], result[BATCH_GROUP];
+        int misses = 0;
+        for (int j = 0; j < size; j++) 
+        {
+            assert(in[first + j] >= 0);
+            // Positions of cached pages are answered right away, the others are searched
+            // together (pages are not filled, as a batch is rarely local enough to reuse them)
+            Page *page = findPage(m, direction, in[first + j] / CACHE_PAGE_SIZE);
+            if (page) 
+            {
+                out[first + j] = page->map[in[first + j] % CACHE_PAGE_SIZE];
+                continue;
+            }
+            index[misses] = first + j;
+            pos[misses++] = in[first + j];
+        }
+        if (misses == 0)
+            continue;
+
+        if (isFrozen) 
+        {
+            const FrozenTree *tree = &frozen->trees[direction];
+            int slots[BATCH_GROUP];
+            frozen->searchBatch(tree, pos, slots, misses);
+            for (int j = 0; j < misses; j++)
+                __builtin_prefetch(&tree->segments[slots[j]]);
+            for (int j = 0; j < misses; j++)
+                result[j] = frozenMap(tree->segments[slots[j]], direction, pos[j]);
+        }
+        else if (direction == STREAM_IN_OUT)
+            mapInOutBatch(m, pos, result, misses);
+        else
+            mapOutInBatch(m, pos, result, misses);
+
+        for (int j = 0; j < misses; j++)
+            out[index[j]] = result[j];
+    }
+}
+
+void MAGICfreeze(MAGIC m) 
+{
+    assert(m);
+
+    flushLog(m);
+    destroyFrozen(m->frozen);
+    m->frozen = calloc(1, sizeof(Frozen));
+    if (!m->frozen)
+        return;
+
+    // Collect the nodes in position order
+    Node *first = m->root;
+    while (first != m->NIL && first->left != m->NIL) 
+    {
+        pushShift(first, m->NIL);
+        first = first->left;
+    }
+    int count = 0;
+    for (Node *node = first; node != m->NIL; node = successor(node, m->NIL))
+        count++;
+    int *positions = malloc((count + 1) * sizeof(int));
+    int *outputs = malloc((count + 1) * sizeof(int));
+    FrozenSegment *in = malloc((count + 1) * sizeof(FrozenSegment));
+    FrozenSegment *out = malloc((count + 2) * sizeof(FrozenSegment));
+    Frozen *frozen = m->frozen;
+    bool ok = positions && outputs && in && out;
+    if (ok) 
+    {
+        // IN -> OUT: after the i first nodes, shift by their deltas
+        // and map nothing before the end of their removals
+        in[0] = (FrozenSegment){ 0, 0 };
+        int i = 0;
+        for (Node *node = first; node != m->NIL; node = successor(node, m->NIL), i++) 
+        {
+            int end = node->delta < 0 ? node->pos - node->delta : 0;
+            positions[i] = node->pos;
+            in[i + 1].shift = in[i].shift + node->delta;
+            in[i + 1].bound = end > in[i].bound ? end : in[i].bound;
+        }
+
+        // OUT -> IN: one segment per run of mapped input positions between nodes
+        int segments = 0;
+        out[0] = (FrozenSegment){ 0, 0 };
+        for (i = 0; i <= count; i++) 
+        {
+            int from = i == 0 ? 0 : positions[i - 1];
+            if (in[i].bound > from)
+                from = in[i].bound;
+            int to = i < count ? positions[i] : INT_MAX;
+            if (from >= to)
+                continue;
+            outputs[segments++] = from + in[i].shift;
+            out[segments].shift = -in[i].shift;
+            out[segments].bound = i < count ? to + in[i].shift : INT_MAX;
+        }
+
+        // Overlapping removals make the outputs non-monotone: OUT -> IN keeps using the tree
+        frozen->outIn = !m->overlapping;
+        ok = buildFrozenTree(&frozen->trees[STREAM_IN_OUT], positions, in, count)
+          && (!frozen->outIn || buildFrozenTree(&frozen->trees[STREAM_OUT_IN], outputs, out, segments));
+    }
+    free(positions);
+    free(outputs);
+    free(in);
+    free(out);
+    if (!ok) 
+    {
+        // Out of memory: keep answering from the tree
+        destroyFrozen(m->frozen);
+        m->frozen = NULL;
+        return;
+    }
+
+    frozen->search = frozenSearchScalar;
+    frozen->searchBatch = frozenSearchBatchScalar;
+#ifdef FROZEN_AVX2
+    if (__builtin_cpu_supports("avx2")) 
+    {
+        frozen->search = frozenSearchAvx2;
+        frozen->searchBatch = frozenSearchBatchAvx2;
+    }
+#endif
+}
+
+void MAGICsplit(MAGIC m, int pos, MAGIC *left, MAGIC *right) 
+{
+    assert(m && pos >= 0 && left && right);
+
+    thaw(m);
+    flushLog(m);
+    // Pages before 'pos' stay valid for the left part
+    invalidatePages(m, pos);
+
+    Node *leftRoot, *rightRoot;
+    int leftHeight, rightHeight;
+    splitTree(m, m->root, blackHeight(m->root, m->NIL), pos, &leftRoot, &leftHeight, &rightRoot, &rightHeight);
+
+    MAGICOptions options = { m->cacheBudget };
+    MAGIC r = MAGICinitWithOptions(&options);
+    r->overlapping = m->overlapping;
+    m->root = leftRoot;
+    r->root = rightRoot;
+
+    // A removal running past 'pos' is continued at the start of the right part
+    int cut = cutRemovals(m, pos);
+    if (cut > 0) 
+    {
+        // Bytes added at 'pos' are shown after the removed ones
+        Node *node = findNode(r, pos);
+        int added = node != r->NIL && node->delta > 0 ? node->delta : 0;
+        if (added)
+            node->delta = 0;
+        insertDelta(r, pos, -cut);
+        if (added)
+            insertAddition(r, pos, added);
+    }
+
+    // Renumber the right part from 0
+    shiftSubtree(r->root, r->NIL, -pos);
+    resetTailFrom(m);
+    resetTailFrom(r);
+    *left = m;
+    *right = r;
+}
+
+void MAGICjoin(MAGIC a, MAGIC b, int offset) 
+{
+    assert(a && b && a != b && offset >= 0);
+
+    thaw(a);
+    flushLog(a);
+    flushLog(b);
+    resetTailFrom(a);
+    assert(a->tailFrom <= offset);
+    invalidatePages(a, offset);
+
+    // Move b after the first 'offset' input positions of a
+    shiftSubtree(b->root, b->NIL, offset);
+    Node *rest = b->root;
+    int restHeight = blackHeight(rest, b->NIL);
+    int height = blackHeight(a->root, a->NIL);
+    int added = 0;
+    while (rest != b->NIL) 
+    {
+        // Detach the first node of b to use it as the middle of the join
+        Node *first = rest;
+        while (first->left != b->NIL) 
+        {
+            pushShift(first, b->NIL);
+            first = first->left;
+        }
+        Node *single;
+        int singleHeight;
+        splitTree(b, rest, restHeight, first->pos + 1, &single, &singleHeight, &rest, &restHeight);
+
+        // Both sides edit the boundary: merge the deltas like insertDelta,
+        // except bytes added at the end of a that stay before a removal of b
+        Node *last = lastNode(a->root, a->NIL);
+        if (last != a->NIL && last->pos == first->pos) 
+        {
+            if (last->delta > 0 && first->delta < 0) 
+            {
+                added = last->delta;
+                last->delta = 0;
+            }
+            last->delta += first->delta;
+            for (; last != a->NIL; last = last->parent)
+                updateTotalDelta(last);
+            free(first);
+            continue;
+        }
+        a->root = joinTrees(a, a->root, height, first, rest, restHeight, &height);
+        rest = b->NIL;
+    }
+    b->root = b->NIL;
+    a->overlapping |= b->overlapping;
+    if (added)
+        insertAddition(a, offset, added);
+    resetTailFrom(a);
+    MAGICdestroy(b);
+}
+
+void MAGICgetStats(MAGIC m, MAGICStats *stats) 
+{
+    assert(m && stats);
+
+    *stats = m->stats;
+}
+
+void MAGICdestroy(MAGIC m) 
+{
+    destroyTree(m->root, m->NIL);
+    while (m->oldest)
+        dropPage(m, m->oldest);
+    free(m->buckets);
+    free(m->log);
+    destroyFrozen(m->frozen);
+    free(m);
+}
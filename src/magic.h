@@ -1,6 +1,8 @@
 #ifndef MAGIC_H
 #define MAGIC_H
 
+#include <stddef.h>
+
 /// @brief Opaque type for the MAGIC ADT (Working like a red-black tree)
 typedef struct magic *MAGIC;
 
@@ -10,27 +12,58 @@ enum MAGICDirection {
     STREAM_OUT_IN = 1   // Map output → input
 };
 
+// Default memory budget of the mapping cache (16 MiB)
+#define MAGIC_DEFAULT_CACHE_BUDGET ((size_t)16 << 20)
+
+/// @brief Options for a new MAGIC instance
+typedef struct MAGICOptions 
+{
+    size_t cacheBudget; // max bytes used by the mapping cache (0 disables it)
+} MAGICOptions;
+
+/// @brief Counters of the work done by a MAGIC instance since its creation
+typedef struct MAGICStats 
+{
+    long long pageFills;         // cache pages rebuilt from the tree
+    long long pageEvictions;     // cache pages evicted to stay within the budget
+    long long pageInvalidations; // cache pages dropped by edits
+    long long logFlushes;        // merges of the edit log into the tree
+} MAGICStats;
+
 /// @brief Initialize a new MAGIC instance.
 /// Worst-case time complexity: O(1)
 /// @return 
 MAGIC MAGICinit();
 
+/// @brief Initialize a new MAGIC instance with the given options.
+/// Worst-case time complexity: O(1)
+/// @param options Options of the instance
+/// @return 
+MAGIC MAGICinitWithOptions(const MAGICOptions *options);
+
 /// @brief Add 'length' bytes starting from position 'pos'. 
-/// Worst-case time complexity: O(log n)
+/// Worst-case time complexity: O(log n + k) (k <= 4096 logged edits)
+/// An edit past every previous one is logged and merged into the tree with the following
+/// ones on the next query, amortized O(1); any other edit is inserted into the tree in O(log n)
 /// @param m MAGIC instance
 /// @param pos Starting position
 /// @param length Number of bytes to add
 void MAGICadd(MAGIC m, int pos, int length);
 
 /// @brief Remove 'length' bytes starting from position 'pos'. 
-/// Worst-case time complexity: O(log n)
+/// Worst-case time complexity: O(log n + k) (k <= 4096 logged edits)
+/// An edit past every previous one is logged and merged into the tree with the following
+/// ones on the next query, amortized O(1); any other edit is inserted into the tree in O(log n)
 /// @param m MAGIC instance
 /// @param pos Starting position
 /// @param length Number of bytes to remove
+/// @note Input positions past INT_MAX do not exist, so the removal stops there
 void MAGICremove(MAGIC m, int pos, int length);
 
 /// @brief Map a position from input to output or vice versa. 
-/// Worst-case time complexity: O(n) but average O(1)
+/// Worst-case time complexity: O(log n + 1024) to fill a cache page (O(log^2 n + 1024) OUT -> IN
+/// once a removal starts inside another one), O(1) on a cached page
+/// Pages of 1024 positions are evicted least recently used first once the budget is reached
 /// @param m MAGIC instance
 /// @param direction Direction of mapping
 /// @param pos Position to map
@@ -38,6 +71,52 @@ void MAGICremove(MAGIC m, int pos, int length);
 /// @note If the position is not in the range of the mapping, the result is -1
 int MAGICmap(MAGIC m, enum MAGICDirection direction, int pos);
 
+/// @brief Map many positions in the same direction, in any order.
+/// Worst-case time complexity: O(k log n) (O(k log^2 n) OUT -> IN once a removal starts
+/// inside another one)
+/// Batches of 32 positions or more per page fill the pages like MAGICmap when they all fit
+/// in the cache. Otherwise, positions of cached pages are read from them and the others
+/// descend in groups so that their memory accesses overlap, without filling pages: faster
+/// than separate MAGICmap calls when the positions spread over more pages than the cache holds
+/// @param m MAGIC instance
+/// @param direction Direction of mapping
+/// @param in Positions to map
+/// @param out Set to the mapped positions (-1 if none), may be the same array as 'in'
+/// @param count Number of positions
+void MAGICmapBatch(MAGIC m, enum MAGICDirection direction, const int *in, int *out, int count);
+
+/// @brief Freeze the current mapping into flat search trees for a read-heavy phase.
+/// Worst-case time complexity: O(n)
+/// Until the next edit, MAGICmap is answered by a branchless search over blocks of
+/// 16 positions (compared with AVX2 when the processor supports it) in O(log n)
+/// @param m MAGIC instance
+/// @note The next edit frees the flat trees. Once a removal starts inside another one,
+/// OUT -> IN queries keep using the tree
+void MAGICfreeze(MAGIC m);
+
+/// @brief Split a MAGIC instance at an input position.
+/// Worst-case time complexity: O(log n)
+/// @param m MAGIC instance, consumed by the split
+/// @param pos Input position where the right part starts
+/// @param left Set to the mapping of the input positions before 'pos'
+/// @param right Set to the mapping of the input positions from 'pos', both streams renumbered from 0
+/// @note A removal running past 'pos' is shared between both parts
+void MAGICsplit(MAGIC m, int pos, MAGIC *left, MAGIC *right);
+
+/// @brief Append the mapping of 'b' after the first 'offset' input positions of 'a'.
+/// Worst-case time complexity: O(log n)
+/// @param a MAGIC instance receiving the result
+/// @param b MAGIC instance, destroyed by the join
+/// @param offset Input position of 'a' where 'b' starts
+/// @note Every edit of 'a' must lie at or before 'offset'
+void MAGICjoin(MAGIC a, MAGIC b, int offset);
+
+/// @brief Get the work counters of a MAGIC instance.
+/// Worst-case time complexity: O(1)
+/// @param m MAGIC instance
+/// @param stats Set to the counters of 'm'
+void MAGICgetStats(MAGIC m, MAGICStats *stats);
+
 /// @brief Free all resources associated with a MAGIC instance. 
 /// Worst-case time complexity: O(n)
 /// @param m MAGIC instance